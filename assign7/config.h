@@ -100,14 +100,26 @@
 #define UTIL_WEIGHT .5
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (either 8 or 16). Building with
+ * MMFLAGS=-DALIGNMENT=16 makes the allocator and the driver use 16.
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /*
- * Maximum heap size in bytes
+ * Default maximum heap size in bytes. The production library (built
+ * without DRIVER) reserves this much address space and commits it as
+ * needed. mem_set_max_heap (mdriver -H, or MM_MAX_HEAP in the environment
+ * of a program using libmm.so) reserves a different size before mem_init,
+ * up to MAX_HEAP_LIMIT, which bounds the allocator's heap-wide tables.
  */
+#ifdef DRIVER
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#else
+#define MAX_HEAP (1UL<<32)      /* 4 GB */
+#endif
+#define MAX_HEAP_LIMIT (1UL<<35) /* 32 GB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -18,11 +18,15 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
 #include "config.h"
 
 /**********************
@@ -43,6 +47,9 @@
 #define WUTIL 2
 #define WPERF 3
 
+/* Batches allocated and freed per timing of the batch benchmark */
+#define BATCH_ROUNDS 16
+
 /******************************
  * The key compound data types
  *****************************/
@@ -64,9 +71,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
     int index;                        /* index for free() to use later */
     size_t size;                      /* byte size of alloc/realloc request */
+    size_t alignment;                 /* payload alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -92,6 +100,13 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Holds the params to the batch allocation benchmark, timed by fsecs */
+typedef struct {
+    size_t size;   /* payload size of each block */
+    size_t count;  /* blocks per batch */
+    void **ptrs;   /* the blocks of the current batch */
+} batch_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -105,6 +120,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double cycles;   /* number of cycles needed to run the trace (with -C) */
+    double tlb_misses; /* dTLB load misses in one run of the trace (with -T) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -115,7 +132,9 @@ typedef struct {
  * at a "random" place (a hash of the index), and copy random data
  * into it.  With DBG_CHEAP, we check that the data survived when we
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
+ * every operation.  With -i, the allocator checks the blocks each
+ * operation touched, and every block is checked every check_interval
+ * operations.
  * randint_t should be a byte, in case students return unaligned memory.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
@@ -133,6 +152,17 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
+static int stats_flag = 0; /* print mm_stats for each trace */
+static size_t batch_count = 0; /* blocks per batch in the batch benchmark */
+static int check_interval = 0; /* ops between full checks in incremental mode */
+static int fit_policy = MM_FIT_LIFO; /* placement policy set by -p */
+static int sweep_flag = 0; /* run the traces under every placement policy */
+static int cycles_flag = 0; /* also time each trace in cycles with fcyc */
+static int tlb_flag = 0; /* also count dTLB misses for each trace */
+
+/* names of the MM_FIT_* placement policies, by value */
+static const char *policy_names[] = {"lifo", "address", "next", "best"};
+#define NUM_POLICIES (sizeof(policy_names) / sizeof(policy_names[0]))
 
 /* by default, no timeouts */
 static int set_timeout = 0;
@@ -153,7 +183,7 @@ char autoresult[MAXLINE]; /* autoresult string */
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(range_t **ranges, char *lo, size_t size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
@@ -179,8 +209,23 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
 
+/* Compare batched allocation with single mallocs */
+static void eval_single_speed(void *ptr);
+static void eval_batch_speed(void *ptr);
+static void run_batch_bench(size_t count);
+
+/* Compare the placement policies */
+static void set_policy(int policy);
+static void run_policy_sweep(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, range_t *ranges,
+                             speed_t *speed_params);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void print_mm_stats(const trace_t *trace);
+static void print_cycles(int n, stats_t *stats);
+static double count_tlb_misses(speed_t *speed_params);
+static void print_tlb_misses(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -241,6 +286,10 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (cycles_flag)
+                mm_stats[i].cycles = fcyc(eval_mm_speed, speed_params);
+            if (tlb_flag)
+                mm_stats[i].tlb_misses = count_tlb_misses(speed_params);
         }
 
         free_trace(trace);
@@ -280,7 +329,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:b:i:p:H:hVAlDqSPCT")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -338,6 +387,54 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'q': /* Defer coalescing of small freed blocks */
+            mm_mallopt(MM_DEFER_COALESCE, 1);
+            break;
+
+        case 'S': /* Print allocator statistics for each trace */
+            stats_flag = 1;
+            break;
+
+        case 'i': /* Incremental checking with a full check every n ops */
+            check_interval = atoi(optarg);
+            if (check_interval <= 0)
+                app_error("Check interval must be positive");
+            break;
+
+        case 'p': /* Select a placement policy by name */
+            for (fit_policy = 0; fit_policy < (int)NUM_POLICIES; fit_policy++)
+                if (strcmp(optarg, policy_names[fit_policy]) == 0)
+                    break;
+            if (fit_policy == (int)NUM_POLICIES)
+                app_error("Unknown placement policy %s", optarg);
+            mm_mallopt(MM_FIT_POLICY, fit_policy);
+            break;
+
+        case 'P': /* Run the traces under every placement policy */
+            sweep_flag = 1;
+            break;
+
+        case 'C': /* Report cycles per operation for each trace */
+            cycles_flag = 1;
+            break;
+
+        case 'T': /* Report dTLB misses for each trace */
+            tlb_flag = 1;
+            break;
+
+        case 'H': /* Reserve <n> MiB of address space for the heap */
+            if (strtoull(optarg, NULL, 10) > (MAX_HEAP_LIMIT >> 20) ||
+                mem_set_max_heap(strtoull(optarg, NULL, 10) << 20) != 0)
+                app_error("Heap size must be between 1 and %lu MiB",
+                          (unsigned long)(MAX_HEAP_LIMIT >> 20));
+            break;
+
+        case 'b': /* Compare mm_malloc_batch with single mm_malloc calls */
+            batch_count = atoi(optarg);
+            if (batch_count == 0)
+                app_error("Batch size must be positive");
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -430,9 +527,20 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats);
             printf("\n");
+            if (cycles_flag)
+                print_cycles(num_tracefiles, mm_stats);
+            if (tlb_flag)
+                print_tlb_misses(num_tracefiles, mm_stats);
         }
     }
 
+    if (batch_count > 0)
+        run_batch_bench(batch_count);
+
+    if (sweep_flag && !onetime_flag)
+        run_policy_sweep(num_tracefiles, tracedir, tracefiles, ranges,
+                         &speed_params);
+
     /*
      * Accumulate the aggregate statistics for the student's mm package
      */
@@ -557,7 +665,7 @@ int main(int argc, char **argv)
  *     size bytes at addr lo. After checking the block for correctness,
  *     we create a range struct for this block and add it to the range list.
  */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(range_t **ranges, char *lo, size_t size,
                      const trace_t *trace, int opnum, int index)
 {
     char *hi = lo + size - 1;
@@ -572,9 +680,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a region
+       mapped by mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -720,7 +830,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index;
+    size_t size, alignment;
     int max_index = 0;
     int op_index;
 
@@ -776,24 +887,35 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     while (fscanf(tracefile, "%s", type) != EOF) {
         switch(type[0]) {
         case 'a':
-            fscanf(tracefile, "%u %u", &index, &size);
+            fscanf(tracefile, "%d %zu", &index, &size);
             trace->ops[op_index].type = ALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
-            fscanf(tracefile, "%u %u", &index, &size);
+            fscanf(tracefile, "%d %zu", &index, &size);
             trace->ops[op_index].type = REALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
-            fscanf(tracefile, "%ud", &index);
+            fscanf(tracefile, "%d", &index);
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            fscanf(tracefile, "%d %zu %zu", &index, &alignment, &size);
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+                app_error("%s: memalign alignment %zu is not a power of two",
+                          trace->filename, alignment);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].alignment = alignment;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n",
                       type[0], trace->filename);
@@ -881,6 +1003,17 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
                 check_index(trace, i, r->index);
                 r = r->next;
             }
+        } else if (check_interval > 0) {
+            range_t *r;
+
+            /* Check what the last op changed, and everything now and then */
+            if (i % check_interval == 0) {
+                mm_checkheap(verbose);
+                for (r = *ranges; r; r = r->next)
+                    check_index(trace, i, r->index);
+            } else {
+                mm_checkheap_touched();
+            }
         }
 
         switch (trace->ops[i].type) {
@@ -909,6 +1042,29 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             randomize_block(trace, index);
             break;
 
+        case MEMALIGN: /* mm_memalign */
+
+            /* Call the student's memalign */
+            if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL) {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return 0;
+            }
+
+            /* The payload must meet the requested alignment as well */
+            if (((unsigned long)p % trace->ops[i].alignment) != 0) {
+                malloc_error(trace, i, "Payload address (%p) not aligned to %zu bytes",
+                             p, trace->ops[i].alignment);
+                return 0;
+            }
+
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return 0;
+
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             check_index(trace, i, index);
 
@@ -976,11 +1132,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/footprint, where footprint is the
+ *   peak size of the heap plus any regions from mem_map while running
+ *   the student's malloc package on the trace. The heap may shrink, so
+ *   the final brk is not necessarily the high water mark.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -988,14 +1143,21 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 {
     int i;
     int index;
-    int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t size, newsize, oldsize;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
+    int last_alloc = -1;
     char *p;
     char *newp, *oldp;
 
     reinit_trace(trace);
 
+    /* statistics are printed after the last allocation, before the
+       trace's closing frees undo any fragmentation */
+    for (i = 0; i < trace->num_ops; i++)
+        if (trace->ops[i].type != FREE)
+            last_alloc = i;
+
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
@@ -1020,6 +1182,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL) {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1035,7 +1213,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             trace->blocks[index] = newp;
             trace->block_sizes[index] = newsize;
 
-            total_size += (newsize - oldsize);
+            total_size += newsize;
+            total_size -= oldsize;
             break;
 
         case FREE: /* mm_free */
@@ -1061,11 +1240,14 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        if (stats_flag && i == last_alloc)
+            print_mm_stats(trace);
     }
 
     //printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -1075,7 +1257,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index;
+    size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
@@ -1097,6 +1280,14 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1121,6 +1312,133 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_single_speed - allocates BATCH_ROUNDS batches of blocks with one
+ *     mm_malloc call per block and frees each batch
+ */
+static void eval_single_speed(void *ptr)
+{
+    batch_t *batch = (batch_t *)ptr;
+    size_t i;
+    int round;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_single_speed");
+
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        for (i = 0; i < batch->count; i++) {
+            if ((batch->ptrs[i] = mm_malloc(batch->size)) == NULL)
+                app_error("mm_malloc error in eval_single_speed");
+            *(char *)batch->ptrs[i] = 0;
+        }
+        for (i = 0; i < batch->count; i++)
+            mm_free(batch->ptrs[i]);
+    }
+}
+
+/*
+ * eval_batch_speed - allocates BATCH_ROUNDS batches of blocks with one
+ *     mm_malloc_batch call per batch and frees each batch
+ */
+static void eval_batch_speed(void *ptr)
+{
+    batch_t *batch = (batch_t *)ptr;
+    size_t i;
+    int round;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_batch_speed");
+
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        if (mm_malloc_batch(batch->size, batch->count, batch->ptrs) != batch->count)
+            app_error("mm_malloc_batch error in eval_batch_speed");
+        for (i = 0; i < batch->count; i++)
+            *(char *)batch->ptrs[i] = 0;
+        for (i = 0; i < batch->count; i++)
+            mm_free(batch->ptrs[i]);
+    }
+}
+
+/*
+ * run_batch_bench - times allocating batches of count blocks of several
+ *     sizes with mm_malloc_batch against count single mm_malloc calls.
+ *     Both free the blocks one at a time, and the rates count allocations.
+ */
+static void run_batch_bench(size_t count)
+{
+    static const size_t sizes[] = {16, 48, 128, 512, 2048};
+    batch_t batch;
+    double ops = (double)count * BATCH_ROUNDS;
+    double single_secs, batch_secs;
+    unsigned int i;
+
+    if ((batch.ptrs = calloc(count, sizeof(void *))) == NULL)
+        unix_error("ptrs calloc in run_batch_bench failed");
+    batch.count = count;
+
+    mem_init();
+    printf("Batch allocation of %zu blocks, %d rounds:\n", count, BATCH_ROUNDS);
+    printf("  %6s%12s%12s%9s\n", "size", "malloc Kops", "batch Kops", "speedup");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        batch.size = sizes[i];
+        single_secs = fsecs(eval_single_speed, &batch);
+        batch_secs = fsecs(eval_batch_speed, &batch);
+        printf("  %6zu%12.0f%12.0f%8.2fx\n", sizes[i],
+               ops / 1e3 / single_secs, ops / 1e3 / batch_secs,
+               single_secs / batch_secs);
+    }
+    printf("\n");
+    mem_deinit();
+    free(batch.ptrs);
+}
+
+/*
+ * set_policy - sets the placement policy between traces.  Switching
+ *     policies may reorder the free lists, so the allocator is given a
+ *     fresh heap rather than the last trace's discarded one.
+ */
+static void set_policy(int policy)
+{
+    mem_init();
+    if (mm_init() < 0)
+        app_error("mm_init failed in set_policy");
+    mm_mallopt(MM_FIT_POLICY, policy);
+    mem_deinit();
+}
+
+/*
+ * run_policy_sweep - runs the traces under each placement policy and
+ *     prints a results table for each, then restores the policy chosen
+ *     with -p.
+ */
+static void run_policy_sweep(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, range_t *ranges,
+                             speed_t *speed_params)
+{
+    stats_t *stats;
+    unsigned int i;
+
+    if ((stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t))) == NULL)
+        unix_error("stats calloc in run_policy_sweep failed");
+
+    for (i = 0; i < NUM_POLICIES; i++) {
+        set_policy(i);
+        memset(stats, 0, num_tracefiles * sizeof(stats_t));
+        run_tests(num_tracefiles, tracedir, tracefiles, stats, ranges,
+                  speed_params);
+        printf("Results for placement policy %s:\n", policy_names[i]);
+        printresults(num_tracefiles, stats);
+        printf("\n");
+        if (cycles_flag)
+            print_cycles(num_tracefiles, stats);
+    }
+
+    set_policy(fit_policy);
+    free(stats);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1129,7 +1447,8 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace)
 {
-    int i, newsize;
+    int i;
+    size_t newsize;
     char *p, *newp, *oldp;
 
     reinit_trace(trace);
@@ -1145,6 +1464,15 @@ static int eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            if (posix_memalign((void **)&p, trace->ops[i].alignment,
+                               trace->ops[i].size) != 0) {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1179,7 +1507,8 @@ static int eval_libc_valid(trace_t *trace)
 static void eval_libc_speed(void *ptr)
 {
     int i;
-    int index, size, newsize;
+    int index;
+    size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -1195,6 +1524,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (posix_memalign((void **)&p, trace->ops[i].alignment, size) != 0)
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1223,6 +1560,132 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * print_mm_stats - prints the statistics reported by mm_stats
+ */
+static void print_mm_stats(const trace_t *trace)
+{
+    struct mm_stats stats;
+    unsigned int i;
+
+    mm_stats(&stats);
+
+    printf("Statistics for %s after its last allocation:\n", trace->filename);
+    printf("  heap %zu bytes, mapped %zu bytes, live %zu bytes\n",
+           stats.heap_size, stats.mapped_size, stats.live_bytes);
+    printf("  free %zu bytes, largest free block %zu bytes\n",
+           stats.free_bytes, stats.largest_free);
+    printf("  free blocks by class (smallest size:count):");
+    for (i = 0; i < stats.num_classes; i++)
+        if (stats.free_blocks[i] != 0)
+            printf(" %zu:%lu", stats.class_min_size[i], stats.free_blocks[i]);
+    printf("\n");
+    printf("  splits %lu, coalesces %lu, heap extensions %lu, heap trims %lu\n",
+           stats.splits, stats.coalesces, stats.extends, stats.trims);
+    printf("  find_fit calls %lu, blocks scanned %lu (%.2f per call)\n",
+           stats.fit_calls, stats.fit_scans,
+           stats.fit_calls ? (double)stats.fit_scans / stats.fit_calls : 0.0);
+}
+
+/*
+ * print_cycles - prints the cycles per operation measured with fcyc
+ *     for each valid trace, noting whether the allocator was built
+ *     with CACHE_LAYOUT so that two builds can be compared
+ */
+static void print_cycles(int n, stats_t *stats)
+{
+    double sumcycles = 0;
+    double sumops = 0;
+    int i;
+
+#ifdef CACHE_LAYOUT
+    printf("Cycles per operation (cache layout on):\n");
+#else
+    printf("Cycles per operation (cache layout off):\n");
+#endif
+    printf("  %8s%11s  %s\n", "ops", "cycles/op", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("  %8.0f%11.1f  %s\n", stats[i].ops,
+               stats[i].cycles / stats[i].ops, stats[i].filename);
+        sumcycles += stats[i].cycles;
+        sumops += stats[i].ops;
+    }
+    if (sumops > 0)
+        printf("  %8.0f%11.1f  Total\n", sumops, sumcycles / sumops);
+    printf("\n");
+}
+
+/*
+ * count_tlb_misses - runs a trace once with a hardware counter of dTLB
+ *     load misses in this process.  Returns -1 if the counter cannot be
+ *     opened (no PMU, or perf_event_paranoid forbids it).
+ */
+static double count_tlb_misses(speed_t *speed_params)
+{
+    struct perf_event_attr attr;
+    long long count;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    eval_mm_speed(speed_params);
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(fd);
+    return (double)count;
+}
+
+/*
+ * print_tlb_misses - prints the dTLB load misses per thousand operations
+ *     for each valid trace, with the size of the pages backing the heap
+ *     so that builds with and without HUGE_PAGES can be compared
+ */
+static void print_tlb_misses(int n, stats_t *stats)
+{
+    double summisses = 0;
+    double sumops = 0;
+    int i;
+
+    mem_init();
+    printf("dTLB load misses (heap pages of %zu KiB):\n",
+           mem_heap_pagesize() / 1024);
+    mem_deinit();
+    printf("  %8s%12s%11s  %s\n", "ops", "misses", "per Kop", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        if (stats[i].tlb_misses < 0) {
+            printf("  dTLB miss counter unavailable\n\n");
+            return;
+        }
+        printf("  %8.0f%12.0f%11.2f  %s\n", stats[i].ops, stats[i].tlb_misses,
+               stats[i].tlb_misses / (stats[i].ops / 1e3), stats[i].filename);
+        summisses += stats[i].tlb_misses;
+        sumops += stats[i].ops;
+    }
+    if (sumops > 0)
+        printf("  %8.0f%12.0f%11.2f  Total\n", sumops, summisses,
+               summisses / (sumops / 1e3));
+    printf("\n");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -1375,10 +1838,11 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDqSPCT] [-f <file>] [-i <n>] [-p <policy>] [-H <n>] [-b <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
+    fprintf(stderr, "\t-i <n>     Check blocks touched by each op, all blocks every <n> ops.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
@@ -1387,4 +1851,12 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-q         Defer coalescing of small freed blocks.\n");
+    fprintf(stderr, "\t-S         Print allocator statistics for each trace.\n");
+    fprintf(stderr, "\t-p <pol>   Placement policy: lifo (default), address, next or best.\n");
+    fprintf(stderr, "\t-P         Also run the traces under every placement policy.\n");
+    fprintf(stderr, "\t-C         Report cycles per operation for each trace.\n");
+    fprintf(stderr, "\t-T         Report dTLB misses for each trace.\n");
+    fprintf(stderr, "\t-H <n>     Reserve <n> MiB of address space for the heap.\n");
+    fprintf(stderr, "\t-b <n>     Compare mm_malloc_batch of <n> blocks with <n> mm_mallocs.\n");
 }
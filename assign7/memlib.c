@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE				/* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -16,60 +17,311 @@
 #include "memlib.h"
 #include "config.h"
 
+#ifdef HUGE_PAGES
+#define HUGE_PAGE_SIZE (1UL << 21)	/* 2 MiB, the x86-64 huge page size */
+#endif
+
 /* private variables */
 static char *heap;
 static char *mem_brk;
+static char *mem_fresh;             /* heap from here on has never been handed out */
+static char *mem_sbrk_top;          /* highest brk backed by a real sbrk call */
 static char *mem_max_addr;
+static size_t mem_peak;            /* largest heap plus mapped size seen */
+static size_t huge_page_size;      /* size of huge pages backing the heap (0 if none) */
+static size_t max_heap = MAX_HEAP; /* bytes reserved for the heap by mem_init */
 
-/* 
- * mem_init - initialize the memory system model
+/* regions mapped outside the heap by mem_map */
+typedef struct {
+	char *addr;
+	size_t size;
+} region_t;
+
+static region_t *regions;
+static int num_regions;
+static int max_regions;
+static size_t mapped_size;         /* total size of mapped regions */
+
+/*
+ * update_peak - record the current footprint if it is a new high
  */
-void mem_init(void){
+static void update_peak(void) {
+	size_t footprint = (size_t)(mem_brk - heap) + mapped_size;
+
+	if (footprint > mem_peak)
+		mem_peak = footprint;
+}
+
+/*
+ * unmap_all - release every mapped region
+ */
+static void unmap_all(void) {
+	int i;
+
+	for (i = 0; i < num_regions; i++)
+		munmap(regions[i].addr, regions[i].size);
+	num_regions = 0;
+	mapped_size = 0;
+}
+
+#ifdef HUGE_PAGES
+/*
+ * map_huge_heap - map the heap with huge pages: explicit ones from the
+ *		hugetlbfs pool if it can reserve the whole heap, else transparent
+ *		huge pages. Returns NULL if neither is available.
+ */
+static char *map_huge_heap(void) {
+	// Without MAP_NORESERVE the pool is reserved up front, so a short pool
+	// fails here rather than with SIGBUS when a page is first touched
+	char *addr = mmap((void *)0x800000000, max_heap, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (addr != MAP_FAILED)
+		return addr;
+
+	addr = mmap((void *)0x800000000, max_heap, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	if (((size_t)addr & (HUGE_PAGE_SIZE - 1)) != 0 ||
+			madvise(addr, max_heap, MADV_HUGEPAGE) != 0) {
+		munmap(addr, max_heap);
+		return NULL;
+	}
+	return addr;
+}
+#endif
+
+/*
+ * map_heap - map the heap with ordinary pages
+ */
+static char *map_heap(void) {
 	int dev_zero = open("/dev/zero", O_RDWR);
-	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
+	char *addr = mmap((void *)0x800000000, /* suggested start*/
+			max_heap,				/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
+	close(dev_zero);
+	return addr;
+}
+
+/*
+ * mem_set_max_heap - set the size of the heap reserved by the next
+ *		mem_init, rounded up to whole pages. Returns 0 on success and -1 if
+ *		the size is zero or above MAX_HEAP_LIMIT.
+ */
+int mem_set_max_heap(size_t size) {
+	if (size == 0 || size > MAX_HEAP_LIMIT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	max_heap = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+	return 0;
+}
+
+/*
+ * mem_max_heap - returns the size of the heap reservation
+ */
+size_t mem_max_heap(void) {
+	return max_heap;
+}
+
+/* 
+ * mem_init - initialize the memory system model. With HUGE_PAGES the
+ *		heap is backed by huge pages when the system has them.
+ */
+void mem_init(void){
+	heap = NULL;
+	huge_page_size = 0;
+#ifdef HUGE_PAGES
+	if ((heap = map_huge_heap()) != NULL)
+		huge_page_size = HUGE_PAGE_SIZE;
+#endif
+	if (heap == NULL)
+		heap = map_heap();
+	mem_max_addr = heap + max_heap;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_fresh = heap;
+	mem_sbrk_top = heap;
+	mem_peak = 0;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+	unmap_all();
+	munmap(heap, max_heap);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *		Mapped regions are released and the peak footprint is cleared.
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	unmap_all();
+	mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap and returns the pages above the new
+ *		brk to the system; growing it again reuses the range up to the
+ *		highest brk so far before calling sbrk.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
+	if (incr < 0) {
+		char *page;
+
+		if (mem_brk + incr < heap) {
+			errno = EINVAL;
+			fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below start of heap...\n");
+			return (void *)-1;
+		}
+
+		mem_brk += incr;
+
+		// Drop whole pages above the new brk; they read as zero when touched again.
+		// The real brk is left alone, since libc may have grown it since.
+		page = heap + (((mem_brk - heap) + mem_heap_pagesize() - 1) & ~(mem_heap_pagesize() - 1));
+		if (page < old_brk && madvise(page, old_brk - page, MADV_DONTNEED) == 0 &&
+				old_brk >= mem_fresh)
+			mem_fresh = page;
+
+		return (void *)old_brk;
+	}
+
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+	// The process break never moves down, so growth below the highest brk
+	// reached so far reuses that range and only the rest calls sbrk.
+	if ( ((mem_brk + incr) > mem_max_addr) ||
+            ((mem_brk + incr) > mem_sbrk_top &&
+             sbrk((mem_brk + incr) - mem_sbrk_top) == (void *) -1)) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	if (mem_brk > mem_sbrk_top)
+		mem_sbrk_top = mem_brk;
+	if (mem_brk > mem_fresh)
+		mem_fresh = mem_brk;
+	update_peak();
 	return (void *)old_brk;
 }
 
+/*
+ * mem_map - model of an anonymous mmap outside the heap. Maps size bytes
+ *		(a multiple of the page size) of zeroed memory and returns its
+ *		address, or (void *)-1 on failure.
+ */
+void *mem_map(size_t size) {
+	char *addr;
+
+	if (num_regions == max_regions) {
+		int new_max = max_regions ? 2 * max_regions : 64;
+		region_t *new_regions = realloc(regions, new_max * sizeof(region_t));
+
+		if (new_regions == NULL) {
+			errno = ENOMEM;
+			return (void *)-1;
+		}
+		regions = new_regions;
+		max_regions = new_max;
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+
+	regions[num_regions].addr = addr;
+	regions[num_regions].size = size;
+	num_regions++;
+	mapped_size += size;
+	update_peak();
+	return (void *)addr;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map. Returns 0 on success
+ *		and -1 if addr and size do not name a mapped region.
+ */
+int mem_unmap(void *addr, size_t size) {
+	int i;
+
+	for (i = 0; i < num_regions; i++) {
+		if (regions[i].addr == addr && regions[i].size == size) {
+			munmap(addr, size);
+			mapped_size -= size;
+			regions[i] = regions[--num_regions];
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_unmap failed. No region mapped at %p...\n", addr);
+	return -1;
+}
+
+/*
+ * mem_remap - resize a region returned by mem_map to new_size bytes,
+ *		moving it if necessary. Returns the new address, or (void *)-1 on
+ *		failure, in which case the region is unchanged.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+	int i;
+	char *new_addr;
+
+	for (i = 0; i < num_regions; i++) {
+		if (regions[i].addr == addr && regions[i].size == old_size)
+			break;
+	}
+
+	if (i == num_regions) {
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_remap failed. No region mapped at %p...\n", addr);
+		return (void *)-1;
+	}
+
+	new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+	if (new_addr == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+
+	regions[i].addr = new_addr;
+	regions[i].size = new_size;
+	mapped_size = mapped_size - old_size + new_size;
+	update_peak();
+	return (void *)new_addr;
+}
+
+/*
+ * mem_is_mapped - return nonzero if the bytes lo..hi lie within one
+ *		mapped region
+ */
+int mem_is_mapped(void *lo, void *hi) {
+	int i;
+
+	for (i = 0; i < num_regions; i++) {
+		if ((char *)lo >= regions[i].addr &&
+				(char *)hi < regions[i].addr + regions[i].size)
+			return 1;
+	}
+	return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +336,15 @@ void *mem_heap_hi(){
 	return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_fresh - return the address from which the heap has not been
+ *		handed out by mem_sbrk since it was mapped or dropped, so reads as
+ *		zero. mem_reset_brk leaves the old contents, so it stays put.
+ */
+void *mem_heap_fresh(){
+	return (void *)mem_fresh;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -91,9 +352,32 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_mapsize() - returns the total size of mapped regions in bytes
+ */
+size_t mem_mapsize() {
+	return mapped_size;
+}
+
+/*
+ * mem_peak_footprint() - returns the largest heap size plus mapped size
+ *		seen since the heap was last reset
+ */
+size_t mem_peak_footprint() {
+	return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages backing the heap:
+ *		the huge page size if mem_init got huge pages, else the page size
+ */
+size_t mem_heap_pagesize(){
+	return huge_page_size ? huge_page_size : mem_pagesize();
+}
@@ -1,11 +1,22 @@
 #include <unistd.h>
+#include <stdint.h>
 
+int mem_set_max_heap(size_t size);
+size_t mem_max_heap(void);
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_map(size_t size);
+int mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+int mem_is_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_fresh(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peak_footprint(void);
 size_t mem_pagesize(void);
+size_t mem_heap_pagesize(void);
 
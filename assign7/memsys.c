@@ -0,0 +1,349 @@
+/*
+ * memsys.c - the memory system of the production library (libmm.so). It
+ *		provides the memlib.h interface with real system memory in place
+ *		of memlib.c's simulation. The heap is a range of address space
+ *		reserved when the library starts and committed as it grows, so it
+ *		stays contiguous however else the program break is moved; mapped
+ *		regions come straight from mmap. Nothing here may call malloc.
+ */
+#define _GNU_SOURCE				/* for mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "memlib.h"
+#include "config.h"
+
+#ifdef HUGE_PAGES
+#define HUGE_PAGE_SIZE (1UL << 21)	/* 2 MiB, the x86-64 huge page size */
+#endif
+
+/* private variables */
+static char *heap;                 /* start of reserved range */
+static char *mem_brk;
+static char *mem_fresh;            /* heap from here on has never been handed out */
+static char *mem_commit;           /* end of pages made accessible */
+static char *mem_max_addr;
+static size_t mem_peak;            /* largest heap plus mapped size seen */
+static size_t mapped_size;         /* total size of mapped regions */
+static size_t page_size;
+static size_t heap_page_size;      /* page_size, or HUGE_PAGE_SIZE with huge pages */
+static size_t max_heap = MAX_HEAP; /* bytes of address space reserved for the heap */
+
+/*
+ * update_peak - record the current footprint if it is a new high. Mapped
+ *		regions may change concurrently, so the peak is raised atomically.
+ */
+static void update_peak(void) {
+	size_t footprint = (size_t)(mem_brk - heap) +
+		__atomic_load_n(&mapped_size, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+	while (footprint > peak &&
+			!__atomic_compare_exchange_n(&mem_peak, &peak, footprint, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#ifdef HUGE_PAGES
+/*
+ * reserve_huge_heap - reserve a huge page aligned range for the heap and
+ *		ask for transparent huge pages in it. Explicit hugetlbfs pages are
+ *		not used, as running out of them kills the program with SIGBUS.
+ *		Returns NULL if the system has no transparent huge pages.
+ */
+static char *reserve_huge_heap(void) {
+	char *addr = mmap(NULL, max_heap + HUGE_PAGE_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	char *start;
+
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	// Trim the reservation to an aligned start
+	start = (char *)(((size_t)addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	if (start > addr)
+		munmap(addr, start - addr);
+	munmap(start + max_heap, addr + HUGE_PAGE_SIZE - start);
+
+	if (madvise(start, max_heap, MADV_HUGEPAGE) != 0) {
+		munmap(start, max_heap);
+		return NULL;
+	}
+	return start;
+}
+#endif
+
+/*
+ * mem_set_max_heap - set the size of the reservation made by mem_init,
+ *		rounded up to whole pages. Returns 0 on success and -1 if the size
+ *		is zero or above MAX_HEAP_LIMIT, or the heap is already reserved.
+ */
+int mem_set_max_heap(size_t size) {
+	size_t page = (size_t)getpagesize();
+
+	if (heap != NULL || size == 0 || size > MAX_HEAP_LIMIT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	max_heap = (size + page - 1) & ~(page - 1);
+	return 0;
+}
+
+/*
+ * mem_max_heap - returns the size of the heap reservation
+ */
+size_t mem_max_heap(void) {
+	return max_heap;
+}
+
+/*
+ * mem_init - reserve address space for the heap. Pages are not usable
+ *		until mem_sbrk commits them. The reservation is MAX_HEAP bytes, or
+ *		the number of MiB in the MM_MAX_HEAP environment variable when it
+ *		is set and valid. With HUGE_PAGES the heap is backed by transparent
+ *		huge pages when the system has them and is committed in whole huge
+ *		pages. Calling it again has no effect.
+ */
+void mem_init(void){
+	const char *env = getenv("MM_MAX_HEAP");
+
+	if (heap != NULL)
+		return;
+
+	if (env != NULL && strtoull(env, NULL, 10) <= (MAX_HEAP_LIMIT >> 20))
+		mem_set_max_heap(strtoull(env, NULL, 10) << 20);
+
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+	heap_page_size = page_size;
+#ifdef HUGE_PAGES
+	if ((heap = reserve_huge_heap()) != NULL)
+		heap_page_size = HUGE_PAGE_SIZE;
+#endif
+	if (heap == NULL)
+		heap = mmap(NULL, max_heap, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (heap == MAP_FAILED) {
+		heap = NULL;
+		return;
+	}
+	mem_max_addr = heap + max_heap;
+	mem_brk = heap;
+	mem_commit = heap;
+	mem_fresh = heap;
+}
+
+/*
+ * mem_deinit - release the heap's address space. Mapped regions are not
+ *		tracked and stay mapped until their blocks are freed.
+ */
+void mem_deinit(void){
+	if (heap == NULL)
+		return;
+
+	munmap(heap, max_heap);
+	heap = NULL;
+}
+
+/*
+ * mem_reset_brk - empty the heap, returning its pages to the system
+ */
+void mem_reset_brk(){
+	if (mem_brk > heap && madvise(heap, mem_commit - heap, MADV_DONTNEED) == 0)
+		mem_fresh = heap;
+	mem_brk = heap;
+	mem_peak = 0;
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start address of
+ *		the new area, committing pages of the reservation as needed. A
+ *		negative incr shrinks the heap and returns the pages above the new
+ *		brk to the system; they stay committed and read as zero when
+ *		touched again. Callers serialize calls.
+ */
+void *mem_sbrk(intptr_t incr) {
+	char *old_brk = mem_brk;
+
+	if (heap == NULL) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+
+	if (incr < 0) {
+		char *page;
+
+		if (mem_brk + incr < heap) {
+			errno = EINVAL;
+			return (void *)-1;
+		}
+
+		mem_brk += incr;
+
+		page = heap + (((mem_brk - heap) + heap_page_size - 1) & ~(heap_page_size - 1));
+		if (page < old_brk && madvise(page, old_brk - page, MADV_DONTNEED) == 0 &&
+				old_brk >= mem_fresh)
+			mem_fresh = page;
+
+		return (void *)old_brk;
+	}
+
+	if ((mem_brk + incr) > mem_max_addr) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+
+	if (mem_brk + incr > mem_commit) {
+		char *new_commit = heap + (((mem_brk + incr - heap) + heap_page_size - 1) & ~(heap_page_size - 1));
+
+		if (mprotect(mem_commit, new_commit - mem_commit, PROT_READ | PROT_WRITE) != 0) {
+			errno = ENOMEM;
+			return (void *)-1;
+		}
+		mem_commit = new_commit;
+	}
+
+	mem_brk += incr;
+	if (mem_brk > mem_fresh)
+		mem_fresh = mem_brk;
+	update_peak();
+	return (void *)old_brk;
+}
+
+/*
+ * mem_map - map size bytes (a multiple of the page size) of zeroed memory
+ *		outside the heap and return its address, or (void *)-1 on failure
+ */
+void *mem_map(size_t size) {
+	char *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (addr == MAP_FAILED) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+
+	__atomic_add_fetch(&mapped_size, size, __ATOMIC_RELAXED);
+	update_peak();
+	return (void *)addr;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map. Returns 0 on success
+ *		and -1 on failure.
+ */
+int mem_unmap(void *addr, size_t size) {
+	if (munmap(addr, size) != 0)
+		return -1;
+
+	__atomic_sub_fetch(&mapped_size, size, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * mem_remap - resize a region returned by mem_map to new_size bytes,
+ *		moving it if necessary. Returns the new address, or (void *)-1 on
+ *		failure, in which case the region is unchanged.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+	char *new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+
+	if (new_addr == MAP_FAILED) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+
+	if (new_size > old_size)
+		__atomic_add_fetch(&mapped_size, new_size - old_size, __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&mapped_size, old_size - new_size, __ATOMIC_RELAXED);
+	update_peak();
+	return (void *)new_addr;
+}
+
+/*
+ * mem_is_mapped - return nonzero if the bytes lo..hi lie outside the heap
+ *		in mapped memory. Regions are not tracked, so this asks the system
+ *		whether the pages are mapped at all.
+ */
+int mem_is_mapped(void *lo, void *hi) {
+	char *first = (char *)((size_t)lo & ~(page_size - 1));
+	unsigned char vec[64];
+	size_t len = (char *)hi + 1 - first;
+
+	if ((char *)hi >= heap && (char *)lo < mem_max_addr)
+		return 0;
+
+	while (len > 0) {
+		size_t chunk = (len < sizeof(vec) * page_size) ? len : sizeof(vec) * page_size;
+
+		if (mincore(first, chunk, vec) != 0)
+			return 0;
+		first += chunk;
+		len -= chunk;
+	}
+	return 1;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(){
+	return (void *)heap;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi(){
+	return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heap_fresh - return the address from which the heap has not been
+ *		handed out by mem_sbrk since it was reserved or its pages were
+ *		returned to the system, so reads as zero
+ */
+void *mem_heap_fresh(){
+	return (void *)mem_fresh;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize() {
+	return (size_t)(mem_brk - heap);
+}
+
+/*
+ * mem_mapsize() - returns the total size of mapped regions in bytes
+ */
+size_t mem_mapsize() {
+	return __atomic_load_n(&mapped_size, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_peak_footprint() - returns the largest heap size plus mapped size
+ *		seen since the heap was last reset
+ */
+size_t mem_peak_footprint() {
+	return __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize(){
+	return (size_t)getpagesize();
+}
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages backing the heap:
+ *		the huge page size if mem_init got huge pages, else the page size
+ */
+size_t mem_heap_pagesize(){
+	return heap_page_size ? heap_page_size : mem_pagesize();
+}
@@ -2,33 +2,92 @@
  * mm_sfl.c
  *
  * Segregated free list implementation.
- *  - 9 size classes for storing free blocks
+ *  - Size classes for storing free blocks: each power of two from 2^5 up to 2^SIZE_CLASS_MAX_POW is split into
+ *    2^SIZE_CLASS_SUB_BITS sub-classes, plus one class below 2^5 and one above 2^SIZE_CLASS_MAX_POW. With the
+ *    default 2 sub-class bits up to 2^12:
  *      index   size [bytes]
  *      0       24      -   32  (2^5)
- *      1       33      -   64  (2^6)
- *      2       65      -   128 (2^7)
- *      3       129     -   256 (2^8)
- *      4       257     -   512 (2^9)
- *      5       513     -   1024(2^10)
- *      6       1025    -   2048(2^11)
- *      7       2049    -   4096(2^12)
- *      8       4097    -   (inf)
+ *      1       33      -   40
+ *      2       41      -   48
+ *      3       49      -   56
+ *      4       57      -   64  (2^6)
+ *      5       65      -   80
+ *      ...
+ *      28      3585    -   4096(2^12)
+ *      29      4097    -   (inf)
+ *    Building with -DSIZE_CLASS_SUB_BITS=0 gives the original 9 power-of-two classes.
  *  - First fit scheme in size class free list; block splitting implemented
+ *  - Blocks in the last size class are kept in a size-ordered treap instead of a list, giving logarithmic best fit
+ *  - Bitmap of non-empty size classes for constant-time class lookup
  *  - Coalesce after freeing block and after extending heap
- *  - 4096 (2^12) byte minimum heap extension
- *  - Each block has boundary tags
- *  - Each free block has pointers to previous and next free block of same size class in header
+ *  - Page-granular heap growth: extensions start at 4096 (2^12) bytes and double while find_fit keeps missing, up
+ *    to 1/64 of the arena's heap; the free block at the end of the heap is used last
+ *  - Each block has a header; only free blocks have a footer. Headers record whether the previous block is allocated,
+ *    which is all coalescing needs to know when there is no footer to read
+ *  - Each free block has pointers to previous and next free block of same size class in header; with
+ *    COMPRESSED_LINKS they are stored as 32-bit heap offsets, shrinking the minimum block to 16 bytes
+ *  - Optional thread-safe mode (THREAD_SAFE): the shared heap is guarded by a lock and each thread
+ *    keeps a private cache of small blocks that is refilled and drained in batches
+ *  - The heap may be split into independent arenas, each with its own free lists, lock and heap segments;
+ *    threads are assigned to arenas and blocks are always freed to the arena that owns them
+ *  - Optional deferred coalescing (mm_mallopt): freed small blocks wait in quick lists by exact size and are reused
+ *    as they are; they are coalesced in one sweep when find_fit misses or too many are waiting
+ *  - Blocks of at least mmap_threshold bytes get a region of their own from mem_map, released on free; free space
+ *    at the top of the heap beyond a pad of trim_threshold bytes is returned with a negative mem_sbrk once it
+ *    exceeds the pad by trim_threshold
+ *  - 64-bit sizes: heap segments stay under 4 GB so that 32-bit boundary tags hold any heap block, while the heap
+ *    itself may be as large as memlib reserves; requests above MAX_BLK_SIZE are mapped, and mapped regions record
+ *    their size in a full word in front of the header
+ *  - calloc skips clearing memory not written since memlib handed it out: mapped regions, and heap past each
+ *    arena's fresh boundary, which moves up as blocks near the top of the newest segment are handed out
+ *  - Optional slab layer (SLAB_ALLOC): requests up to 64 bytes are served from page-sized runs of equal objects
+ *    with a free bitmap and no per-object header; a run is found from the page of an object's address
+ *  - Aligned allocation (memalign and relatives) carves the aligned payload out of a free block and frees the slack
+ *  - Payloads are aligned to 8 bytes, or to 16 when built with -DALIGNMENT=16 as the x86-64 ABI expects
+ *  - Built without DRIVER it replaces libc's allocator (libmm.so): the heap is created on first use and fork handlers
+ *    keep the locks consistent in the child
+ *  - Optional sampling heap profiler (HEAP_PROFILE): about one allocation per profile_rate bytes records its call
+ *    stack; mm_profile_dump reports live and total bytes by stack
+ *  - Optional hardened mode (HARDENED): allocated blocks end in a canary checked by free and realloc, which also
+ *    catches double frees of cached blocks; free list unlinking and thread cache pops validate their links
+ *  - Batched allocation: mm_malloc_batch carves equal blocks side by side from one free block or heap extension
+ *  - Sized and batched free: in slab builds free_sized skips the slab lookup for sizes the slab layer cannot hold,
+ *    and elsewhere it is free; mm_free_batch sorts the pointers and frees address-adjacent blocks as one under a
+ *    single arena lock
  *
  * Initial inspiration from B&O Section 9.9.14.
  */
 
+#ifdef ARENA_BY_CPU
+#define _GNU_SOURCE // for sched_getcpu
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifdef HEAP_PROFILE
+#include <execinfo.h>
+#include <math.h>
+#endif
+
+#ifdef HARDENED
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /*
  * Macro for debugging
@@ -44,16 +103,127 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define malloc_usable_size mm_malloc_usable_size
+#define free_sized mm_free_sized
+#endif
+
+#ifndef ALIGNMENT
+#define ALIGNMENT 8 // payload alignment and block size granularity (8 or 16)
+#endif
+
+#if (ALIGNMENT != 8) && (ALIGNMENT != 16)
+#error "ALIGNMENT must be 8 or 16"
+#endif
+
+#ifdef CACHE_LAYOUT
+#define CACHE_LINE_SIZE 64 // bytes per cache line
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define CACHE_ALIGNED
 #endif
 
-#define ALIGNMENT 8 // double-word alignment
 #define WORD_SIZE 4 // size of word in bytes
 #define DWORD_SIZE 8 // size of double-word in bytes
 
-#define NUM_SIZE_CLASSES 9 // number of free block size classes
-#define MIN_BLK_SIZE (3 * DWORD_SIZE)
-#define MAX_BLK_SIZE INT_MAX
-#define HEAP_EXT_SIZE (0x1 << 12) // size by which heap is extended
+#ifdef COMPRESSED_LINKS
+#define MIN_BLK_SIZE (2 * DWORD_SIZE) // header, two 4-byte links and footer
+#else
+#define MIN_BLK_SIZE ((3 * DWORD_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) // header, two 8-byte links and footer
+#endif
+#define MAX_BLK_SIZE INT_MAX // largest block taken from the heap; larger requests get a region of their own
+#define MAX_SEG_SIZE (UINT_MAX & ~(HEAP_EXT_MAX - 1)) // largest heap segment, so any block fits a 32-bit tag
+#define MAX_ALLOC_SIZE (SIZE_MAX >> 1) // largest request
+
+#define ALLOC 0x1 // boundary tag bit: block is allocated
+#define PREV_ALLOC 0x2 // header bit: previous block is allocated
+#define MMAPPED 0x4 // header bit: block is a region of its own from mem_map
+#define MMAP_PAD (2 * DWORD_SIZE - WORD_SIZE) // bytes of a mapped region before the block header, starting with its size
+
+#ifdef HARDENED
+#define CANARY_SIZE WORD_SIZE // bytes at the end of an allocated block holding its canary
+#define CANARY_FREED 0xFFFFFFFF // mask turning a canary into the mark of a freed block
+#else
+#define CANARY_SIZE 0
+#endif
+
+#ifndef SIZE_CLASS_SUB_BITS
+#define SIZE_CLASS_SUB_BITS 2 // log2 of number of size classes per power of two
+#endif
+
+#ifndef SIZE_CLASS_MAX_POW
+#define SIZE_CLASS_MAX_POW 12 // blocks larger than 2^SIZE_CLASS_MAX_POW share the last size class
+#endif
+
+#define SIZE_CLASS_MIN_POW 5 // blocks no larger than 2^SIZE_CLASS_MIN_POW share the first size class
+#define NUM_SIZE_CLASSES (((SIZE_CLASS_MAX_POW - SIZE_CLASS_MIN_POW) << SIZE_CLASS_SUB_BITS) + 2)
+
+#if NUM_SIZE_CLASSES > 64
+#error "size classes must fit in the free list bitmap"
+#endif
+
+#define TREE_CLASS (NUM_SIZE_CLASSES - 1) // size class kept in a treap
+
+/*
+ * Size class table generation. SIZE_CLASS_LIMIT(i) is the largest size in class i (0 < i < NUM_SIZE_CLASSES - 1),
+ * found from the power of two group of the class and its sub-class within the group.
+ */
+#define SIZE_CLASS_CLAMP(i) ((i) < 1 ? 1 : ((i) > NUM_SIZE_CLASSES - 2 ? NUM_SIZE_CLASSES - 2 : (i)))
+#define SIZE_CLASS_POW(i) (SIZE_CLASS_MIN_POW + ((SIZE_CLASS_CLAMP(i) - 1) >> SIZE_CLASS_SUB_BITS))
+#define SIZE_CLASS_SUB(i) ((SIZE_CLASS_CLAMP(i) - 1) & ((0x1 << SIZE_CLASS_SUB_BITS) - 1))
+#define SIZE_CLASS_LIMIT(i) \
+    ((0x1UL << SIZE_CLASS_POW(i)) + ((SIZE_CLASS_SUB(i) + 1UL) << (SIZE_CLASS_POW(i) - SIZE_CLASS_SUB_BITS)))
+
+/*
+ * SIZE_CLASS_MIN_BLK(i) is the smallest block size in class i. Block sizes are multiples of DWORD_SIZE.
+ */
+#define SIZE_CLASS_MIN_BLK(i) \
+    ((i) == 0 ? MIN_BLK_SIZE : \
+     ((i) >= NUM_SIZE_CLASSES ? MAX_BLK_SIZE : \
+      (((i) == 1 ? (0x1UL << SIZE_CLASS_MIN_POW) : SIZE_CLASS_LIMIT((i) - 1)) + DWORD_SIZE) & ~(DWORD_SIZE - 1UL)))
+
+#define SIZE_CLASS_MIN_BLK_8(i) \
+    SIZE_CLASS_MIN_BLK(i), SIZE_CLASS_MIN_BLK((i) + 1), SIZE_CLASS_MIN_BLK((i) + 2), SIZE_CLASS_MIN_BLK((i) + 3), \
+    SIZE_CLASS_MIN_BLK((i) + 4), SIZE_CLASS_MIN_BLK((i) + 5), SIZE_CLASS_MIN_BLK((i) + 6), SIZE_CLASS_MIN_BLK((i) + 7)
+#define HEAP_EXT_SIZE (0x1 << 12) // smallest size by which heap is extended
+#define HEAP_EXT_MAX (0x1 << 20) // largest size by which heap is extended
+#define HEAP_EXT_SHIFT 6 // an extension is at most 1/64 of the arena's heap
+#define HEAP_EXT_WINDOW 64 // find_fit calls within which another extension counts as a recent miss
+
+#define TCACHE_MAX_SIZE 512 // largest block size held in thread caches
+#define TCACHE_NUM_BINS ((TCACHE_MAX_SIZE - MIN_BLK_SIZE) / ALIGNMENT + 1) // one bin per block size
+#define TCACHE_FILL 32 // maximum number of blocks in a thread cache bin
+#define TCACHE_BATCH 16 // maximum number of blocks moved by a refill or drain
+
+#define MMAP_DEFAULT_THRESHOLD (0x1 << 17) // default smallest block given its own region
+#define TRIM_DEFAULT_THRESHOLD (0x1 << 17) // default free space at the top of the heap that triggers trimming
+
+#define QUICK_MAX_SIZE 512 // largest block size held in quick lists
+#define QUICK_NUM_BINS ((QUICK_MAX_SIZE - MIN_BLK_SIZE) / ALIGNMENT + 1) // one quick list per block size
+#define QUICK_DEFAULT_MAX 1024 // default number of quick list blocks that triggers a coalescing sweep
+
+#define SLAB_RUN_SIZE (0x1 << 12) // bytes per slab run, which is page aligned
+#define SLAB_MAX_SIZE 64 // largest request served from slab runs
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / DWORD_SIZE) // one slab class per multiple of DWORD_SIZE
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / DWORD_SIZE / 64) // words of free bitmap per run
+#ifndef SLAB_MIN_DEMAND
+#define SLAB_MIN_DEMAND 256 // requests of a slab class served by the general path before its first run
+#endif
+
+#define PROFILE_DEFAULT_RATE (0x1 << 19) // default mean number of bytes allocated between heap profile samples
+#define PROFILE_MAX_DEPTH 32 // frames recorded per sampled stack
+#define PROFILE_SKIP_FRAMES 2 // frames of the profiler and allocator at the top of each stack
+#define PROFILE_NUM_STACKS 4096 // distinct sampled stacks (power of two)
+#define PROFILE_NUM_SAMPLES (0x1 << 16) // live sample table size (power of two, kept at most half full)
+#define PROFILE_FILTER_SIZE (0x1 << 16) // entries in the filter that lets free skip unsampled blocks (power of two)
+
+#define MAX_ARENAS 16 // maximum number of arenas
+#define ARENA_UNIT_SHIFT 16
+#define ARENA_UNIT_SIZE (0x1 << ARENA_UNIT_SHIFT) // granularity of heap ownership when there are several arenas
 
 #pragma pack(1) // pack structs
 
@@ -70,50 +240,228 @@ struct btag
 
 typedef struct btag btag;
 
+/*
+ * free_link
+ *
+ * Link between free blocks. With COMPRESSED_LINKS a link is the block's offset from the start of the heap in
+ * double words (0 for none); free block headers sit one word past a double word boundary, so the offset is exact
+ * and covers 32 GB. Otherwise a link is a plain pointer.
+ */
+#ifdef COMPRESSED_LINKS
+typedef unsigned int free_link; // 4 bytes
+#else
+typedef struct free_hdr * free_link; // 8 bytes
+#endif
+
 /*
  * free_hdr
  * struct for free block headers
  *
- * Includes boundary tag and pointers to previous and next free blocks.
+ * Includes boundary tag and links to previous and next free blocks. Blocks in the treap use the same links for
+ * their left and right children. Treap nodes are ordered by size and then address (by address alone in the
+ * address ordered classes of MM_FIT_ADDRESS); priorities are a hash of the address, so nothing else needs to be
+ * stored in the block.
  */
 struct free_hdr
 {
     btag tag; // 4 bytes
-    struct free_hdr * prev_hdr_addr; // 8 bytes
-    struct free_hdr * next_hdr_addr; // 8 bytes
+    free_link prev_hdr_addr; // 4 or 8 bytes
+    free_link next_hdr_addr; // 4 or 8 bytes
 };
 
 typedef struct free_hdr free_hdr;
+typedef struct free_hdr tree_node;
+
+#pragma pack() // restore default packing
+
+/*
+ * slab_run
+ * struct for slab run headers
+ *
+ * A slab run is the payload of an allocated block of SLAB_RUN_SIZE bytes whose payload is aligned to SLAB_RUN_SIZE,
+ * so runs carved one after another tile the heap. The header is followed by equally sized objects; bit i of
+ * free_map is set when object i is free. Runs with free objects are linked per class.
+ */
+struct slab_run
+{
+    struct slab_run * prev; // previous run with free objects
+    struct slab_run * next; // next run with free objects
+    unsigned int obj_size; // object size in bytes
+    unsigned int num_free; // number of free objects
+    unsigned long free_map[SLAB_MAP_WORDS];
+};
+
+typedef struct slab_run slab_run;
+
+#define SLAB_HDR_SIZE ((sizeof(slab_run) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) // offset of first object
+
+/*
+ * size_class_min_blk
+ *
+ * Smallest block size in each size class, generated at compile time from the size class scheme. Entries past the
+ * last class hold MAX_BLK_SIZE.
+ */
+static const size_t size_class_min_blk[64] =
+{
+    SIZE_CLASS_MIN_BLK_8(0), SIZE_CLASS_MIN_BLK_8(8), SIZE_CLASS_MIN_BLK_8(16), SIZE_CLASS_MIN_BLK_8(24),
+    SIZE_CLASS_MIN_BLK_8(32), SIZE_CLASS_MIN_BLK_8(40), SIZE_CLASS_MIN_BLK_8(48), SIZE_CLASS_MIN_BLK_8(56)
+};
 
 /*
- * free_lists
+ * arena_stats
+ * struct for arena event counters
  *
- * Array of linked lists to store free blocks by size category.
- * 
- *  index   size [bytes]
- *  0       24      -   32  (2^5)
- *  1       33      -   64  (2^6)
- *  2       65      -   128 (2^7)
- *  3       129     -   256 (2^8)
- *  4       257     -   512 (2^9)
- *  5       513     -   1024(2^10)
- *  6       1025    -   2048(2^11)
- *  7       2049    -   4096(2^12)
- *  8       4097    -   (inf)
+ * Counters are only updated under the arena lock, so each costs a plain increment. mm_stats sums them over arenas.
  */
-static free_hdr * free_lists[NUM_SIZE_CLASSES];
+struct arena_stats
+{
+    unsigned long splits; // free blocks split by an allocation or resize
+    unsigned long coalesces; // free neighbors merged into a freed block
+    unsigned long extends; // calls to extend_heap
+    unsigned long trims; // times the heap was shrunk
+    unsigned long fit_calls; // calls to find_fit
+    unsigned long fit_scans; // free blocks examined by first fit searches
+};
+
+typedef struct arena_stats arena_stats;
+
+/*
+ * arena
+ * struct for independent heaps
+ *
+ * Each arena owns a set of heap segments, which are runs of blocks bounded by their own prologue and epilogue,
+ * and the free lists for the blocks in them. An arena grows by extending its newest segment when that segment
+ * is at the top of the heap, and otherwise starts a new segment.
+ *
+ * free_lists: array of linked lists to store free blocks by size class (see size_class_min_blk). The entry for
+ * TREE_CLASS, and under MM_FIT_ADDRESS every entry, is the root of a treap instead. With CACHE_LAYOUT each arena
+ * starts a cache line, which holds the bitmap and the heads of the smallest classes, and arenas never share a line.
+ */
+struct arena
+{
+    unsigned long nonempty; // bit i is set when free_lists[i] is not empty
+    free_hdr * free_lists[NUM_SIZE_CLASSES];
+    btag * epilogue; // epilogue of newest segment (NULL until the arena first grows)
+    size_t heap_size; // bytes of heap obtained by the arena
+    size_t heap_peak; // largest heap_size seen, which bounds extensions so that trimming does not shrink them
+    size_t seg_size; // bytes of the newest segment after its prologue
+    char * fresh; // heap from here to the footer before the epilogue is zero (see claim_fresh)
+    size_t ext_size; // size of next heap extension
+    unsigned int fits_since_ext; // find_fit calls since the heap was last extended
+    free_hdr * rover; // free block where the next search of its class starts under MM_FIT_NEXT
+    arena_stats stats; // event counters
+    free_hdr * quick_lists[QUICK_NUM_BINS]; // freed blocks awaiting coalescing, by exact size
+    unsigned int quick_count; // number of blocks in quick_lists
+#ifdef SLAB_ALLOC
+    slab_run * slabs[SLAB_NUM_CLASSES]; // runs with free objects by object size
+    unsigned int slab_demand[SLAB_NUM_CLASSES]; // requests seen by each slab class, up to SLAB_MIN_DEMAND
+#endif
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock; // guards free_lists and epilogue
+#endif
+} CACHE_ALIGNED;
+
+typedef struct arena arena;
+
+static arena arenas[MAX_ARENAS];
+static unsigned int num_arenas; // number of arenas in use
+
+/*
+ * arena_map
+ *
+ * Owning arena of each ARENA_UNIT_SIZE unit of the heap. Only maintained when there are several arenas, in which
+ * case the heap always grows by whole units so that no unit is shared by two arenas.
+ */
+static unsigned char arena_map[MAX_HEAP_LIMIT / ARENA_UNIT_SIZE];
+
+#ifdef SLAB_ALLOC
+/*
+ * slab_page_map
+ *
+ * Bit i is set when page i of the heap holds a slab run.
+ */
+static unsigned long slab_page_map[MAX_HEAP_LIMIT / SLAB_RUN_SIZE / 64 + 1];
+#endif
+
+static int defer_coalesce; // nonzero when freed small blocks go to quick lists (MM_DEFER_COALESCE)
+static unsigned int quick_max = QUICK_DEFAULT_MAX; // quick list blocks that trigger a sweep (MM_QUICK_MAX)
+static size_t mmap_threshold = MMAP_DEFAULT_THRESHOLD; // 0 when disabled (MM_MMAP_THRESHOLD)
+static size_t trim_threshold = TRIM_DEFAULT_THRESHOLD; // 0 when disabled (MM_TRIM_THRESHOLD)
+static int fit_policy = MM_FIT_LIFO; // free list order and search (MM_FIT_POLICY)
+
+static void quick_sweep(arena * ar);
+#ifdef HEAP_PROFILE
+static void profile_reset(void);
+#endif
 
+static void * heap_lo; // first byte of heap
 static void * heap_ptr; // pointer to initial block
 
+#ifdef HARDENED
+static unsigned int canary_secret; // mixed into every canary, chosen by mm_init
+
+static void __attribute__((noinline, noreturn, cold)) report_corruption(const char * msg, void * ptr);
+#endif
+
+#ifdef THREAD_SAFE
+/*
+ * tcache
+ * struct for thread caches
+ *
+ * Small allocated blocks owned by a thread, binned by exact block size. Cached blocks stay marked
+ * allocated in the heap so they are never coalesced; each links to the next through its payload.
+ */
+struct tcache
+{
+    unsigned long heap_id; // heap the cached blocks were taken from
+    unsigned int counts[TCACHE_NUM_BINS]; // number of blocks in each bin
+    unsigned int refills[TCACHE_NUM_BINS]; // number of blocks taken by the next refill of each bin
+    void * bins[TCACHE_NUM_BINS]; // block header addresses
+};
+
+typedef struct tcache tcache;
+
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER; // serializes heap growth between arenas
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; // drains the thread cache when its thread exits
+static unsigned long heap_id; // incremented by mm_init to invalidate stale thread caches
+static __thread tcache thread_cache;
+static __thread arena * thread_arena; // arena assigned to the thread
+static unsigned int next_arena; // next arena to assign round-robin
+
+static void tcache_create_key(void);
+#endif
+
+#ifdef DEBUG
+#define TOUCH_MAX 64 // blocks recorded between incremental heap checks
+
+#ifdef THREAD_SAFE
+#define TOUCH_THREAD_LOCAL __thread
+#else
+#define TOUCH_THREAD_LOCAL
+#endif
+
+/*
+ * touched_blks
+ *
+ * Headers of blocks created or changed since the last heap check, for mm_checkheap_touched. A block that is merged
+ * into another is dropped, so every entry is the start of a block. When more than TOUCH_MAX blocks change the next
+ * check covers the whole heap instead.
+ */
+static TOUCH_THREAD_LOCAL btag * touched_blks[TOUCH_MAX];
+static TOUCH_THREAD_LOCAL unsigned int num_touched; // entries in touched_blks
+static TOUCH_THREAD_LOCAL int touch_overflow; // nonzero if blocks were not recorded
+#endif
+
 /*
  * max
  *
  * Returns the largest of two values.
- * @param a first unsigned int
- * @param b second unsigned int
+ * @param a first size
+ * @param b second size
  * @return largest value
  */
-static inline unsigned int max(unsigned int a, unsigned int b)
+static inline size_t max(size_t a, size_t b)
 {
     if (a >= b)
     {
@@ -123,12 +471,135 @@ static inline unsigned int max(unsigned int a, unsigned int b)
     return b;
 }
 
+/*
+ * touch_block
+ *
+ * Records a block created or changed by the current operation for the next incremental heap check. Does nothing
+ * unless built with DEBUG.
+ * @param blk_addr address of block header
+ */
+static inline void touch_block(void * blk_addr)
+{
+#ifdef DEBUG
+    for (unsigned int i = 0; i < num_touched; i++)
+    {
+        if (touched_blks[i] == blk_addr)
+        {
+            return;
+        }
+    }
+
+    if (num_touched < TOUCH_MAX)
+    {
+        touched_blks[num_touched++] = blk_addr;
+    }
+    else
+    {
+        touch_overflow = 1;
+    }
+#endif
+}
+
+/*
+ * untouch_block
+ *
+ * Drops a block merged into its neighbor from the blocks awaiting the incremental heap check, as its header is
+ * gone. Does nothing unless built with DEBUG.
+ * @param blk_addr address of former block header
+ */
+static inline void untouch_block(void * blk_addr)
+{
+#ifdef DEBUG
+    for (unsigned int i = 0; i < num_touched; i++)
+    {
+        if (touched_blks[i] == blk_addr)
+        {
+            touched_blks[i] = touched_blks[--num_touched];
+            return;
+        }
+    }
+#endif
+}
+
+/*
+ * lock_arena
+ *
+ * Acquires an arena's lock in thread-safe mode.
+ * @param ar arena
+ */
+static inline void lock_arena(arena * ar)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&ar->lock);
+#endif
+}
+
+/*
+ * unlock_arena
+ *
+ * Releases an arena's lock in thread-safe mode.
+ * @param ar arena
+ */
+static inline void unlock_arena(arena * ar)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&ar->lock);
+#endif
+}
+
+/*
+ * get_owner
+ *
+ * Returns the arena that owns a heap address.
+ * @param mem_addr address within the heap
+ * @return owning arena
+ */
+static inline arena * get_owner(void * mem_addr)
+{
+    if (num_arenas == 1)
+    {
+        return &arenas[0];
+    }
+
+    return &arenas[arena_map[((char *) mem_addr - (char *) heap_lo) >> ARENA_UNIT_SHIFT]];
+}
+
+/*
+ * get_thread_arena
+ *
+ * Returns the arena the calling thread allocates from. Threads are assigned round-robin on first use, or by the
+ * CPU they run on when built with ARENA_BY_CPU.
+ * @return arena
+ */
+static inline arena * get_thread_arena(void)
+{
+#ifdef THREAD_SAFE
+#ifdef ARENA_BY_CPU
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0)
+    {
+        return &arenas[cpu % num_arenas];
+    }
+#endif
+
+    if ((thread_arena == NULL) || (thread_arena >= &arenas[num_arenas]))
+    {
+        thread_arena = &arenas[__sync_fetch_and_add(&next_arena, 1) % num_arenas];
+    }
+
+    return thread_arena;
+#else
+    return &arenas[0];
+#endif
+}
+
 /*
  * make_btag
  *
  * Creates a boundary tag given the size and allocation status of block.
  * @param size size of block (including header and footer)
- * @param alloc allocation status of block (1 indicates allocated)
+ * @param alloc allocation status bits of block (ALLOC and PREV_ALLOC)
  * @return boundary tag
  */
 static inline btag make_btag(size_t size, unsigned char alloc)
@@ -138,6 +609,48 @@ static inline btag make_btag(size_t size, unsigned char alloc)
     return new_btag;
 }
 
+/*
+ * encode_link
+ *
+ * Converts a free block address to a link.
+ * @param blk_addr address of free block header (or NULL)
+ * @return link
+ */
+static inline free_link encode_link(free_hdr * blk_addr)
+{
+#ifdef COMPRESSED_LINKS
+    if (blk_addr == NULL)
+    {
+        return 0;
+    }
+
+    return (free_link) (((char *) blk_addr - (char *) heap_lo) / DWORD_SIZE);
+#else
+    return blk_addr;
+#endif
+}
+
+/*
+ * decode_link
+ *
+ * Converts a link to a free block address.
+ * @param link link
+ * @return address of free block header (or NULL)
+ */
+static inline free_hdr * decode_link(free_link link)
+{
+#ifdef COMPRESSED_LINKS
+    if (link == 0)
+    {
+        return NULL;
+    }
+
+    return (free_hdr *) ((char *) heap_lo + ((size_t) link * DWORD_SIZE) + WORD_SIZE);
+#else
+    return link;
+#endif
+}
+
 /*
  * make_free_hdr
  *
@@ -151,8 +664,8 @@ static inline free_hdr make_free_hdr(btag new_btag, free_hdr * prev_hdr_addr, fr
 {
     free_hdr new_free_hdr;
     new_free_hdr.tag = new_btag;
-    new_free_hdr.prev_hdr_addr = prev_hdr_addr;
-    new_free_hdr.next_hdr_addr = next_hdr_addr;
+    new_free_hdr.prev_hdr_addr = encode_link(prev_hdr_addr);
+    new_free_hdr.next_hdr_addr = encode_link(next_hdr_addr);
     return new_free_hdr;
 }
 
@@ -216,6 +729,49 @@ static inline size_t get_alloc(btag * tag)
     return (tag->blk_info & 0x1);
 }
 
+/*
+ * get_mmapped
+ *
+ * Extract whether a block has a region of its own from header.
+ * @param tag block header
+ * @return nonzero if the block was mapped by mem_map
+ */
+static inline size_t get_mmapped(btag * tag)
+{
+    return (tag->blk_info & MMAPPED);
+}
+
+/*
+ * get_prev_alloc
+ *
+ * Extract allocation status of previous block from header.
+ * @param tag block header
+ * @return nonzero if the previous block is allocated
+ */
+static inline size_t get_prev_alloc(btag * tag)
+{
+    return (tag->blk_info & PREV_ALLOC);
+}
+
+/*
+ * set_prev_alloc
+ *
+ * Update the previous block allocation status recorded in a header.
+ * @param tag block header
+ * @param prev_alloc nonzero if the previous block is allocated
+ */
+static inline void set_prev_alloc(btag * tag, size_t prev_alloc)
+{
+    if (prev_alloc)
+    {
+        tag->blk_info |= PREV_ALLOC;
+    }
+    else
+    {
+        tag->blk_info &= ~PREV_ALLOC;
+    }
+}
+
 /*
  * get_hdr_addr
  *
@@ -243,7 +799,8 @@ static inline void * get_ftr_addr(btag * hdr_addr)
 /*
  * get_prev_hdr_addr
  *
- * Get previous block header address given header address of block.
+ * Get previous block header address given header address of block. Only valid if the previous block is free,
+ * since allocated blocks have no footer.
  * @param hdr_addr address of block header
  * @return address of previous block header
  */
@@ -265,453 +822,4035 @@ static inline void * get_next_hdr_addr(btag * hdr_addr)
 }
 
 /*
- * get_free_lists_index
+ * get_prev_free
  *
- * Returns the appropriate free_lists index for a given size.
- * @param size size of block
- * @return index
+ * Get previous block in free list (or left child in treap).
+ * @param blk_addr address of free block header
+ * @return address of previous free block header
  */
-static unsigned char get_free_lists_index(size_t size)
+static inline free_hdr * get_prev_free(free_hdr * blk_addr)
 {
-    size = (size - 1) >> 5;
-
-    unsigned char index = 0;
-    while ((size != 0x0) && (index < NUM_SIZE_CLASSES - 1))
-    {
-        size = size >> 1;
-        index++;
-    }
-
-    return index;
+    return decode_link(blk_addr->prev_hdr_addr);
 }
 
 /*
- * add_to_free_list
+ * get_next_free
  *
- * Add block to beginning of free list. The block does not need a header or footer for this function.
- * @param mem_addr address of block
- * @param size size of block
+ * Get next block in free list (or right child in treap).
+ * @param blk_addr address of free block header
+ * @return address of next free block header
  */
-static void add_to_free_list(void * mem_addr, size_t size)
+static inline free_hdr * get_next_free(free_hdr * blk_addr)
 {
-    btag new_btag = make_btag(size, 0);
-    unsigned char index = get_free_lists_index(size);
-    free_hdr new_free_hdr = make_free_hdr(new_btag, NULL, free_lists[index]);
-
-    put_free_hdr(mem_addr, new_free_hdr); // rewrite header
-    put_btag(get_ftr_addr(mem_addr), new_btag); // rewrite footer
-
-    free_lists[index] = mem_addr; // insert at beginning of free list
-
-    // Update prev_hdr_addr of next block
-    if (free_lists[index]->next_hdr_addr != NULL)
-    {
-        (free_lists[index]->next_hdr_addr)->prev_hdr_addr = free_lists[index];
-    }
+    return decode_link(blk_addr->next_hdr_addr);
 }
 
 /*
- * remove_from_free_list
+ * set_prev_free
  *
- * Remove block from free list and updates list.
- * @param blk_addr address of block header
+ * Set previous block in free list (or left child in treap).
+ * @param blk_addr address of free block header
+ * @param prev_addr address of previous free block header
  */
-static void remove_from_free_list(free_hdr * blk_addr)
+static inline void set_prev_free(free_hdr * blk_addr, free_hdr * prev_addr)
 {
-    if (blk_addr->prev_hdr_addr == NULL)
-    // first block in list
-    {
-        // Update free list pointer
-        unsigned char index = get_free_lists_index(get_size(&(blk_addr->tag)));
-        free_lists[index] = blk_addr->next_hdr_addr;
-    }
-    else
-    // block not first
-    {
-        // Update next_hdr_addr of previous block
-        (blk_addr->prev_hdr_addr)->next_hdr_addr = blk_addr->next_hdr_addr;
-    }
-    
-    // Update prev_hdr_addr of next block
-    if (blk_addr->next_hdr_addr != NULL)
-    {
-        (blk_addr->next_hdr_addr)->prev_hdr_addr = blk_addr->prev_hdr_addr;
-    }
+    blk_addr->prev_hdr_addr = encode_link(prev_addr);
 }
 
 /*
- * coalesce
+ * set_next_free
  *
- * Checks neighboring blocks of free block (or block intended to be freed) and combines contiguous free blocks if found.
- * @param blk_addr address of block header
- * @return new block header address
+ * Set next block in free list (or right child in treap).
+ * @param blk_addr address of free block header
+ * @param next_addr address of next free block header
  */
-static void * coalesce(btag * blk_addr)
+static inline void set_next_free(free_hdr * blk_addr, free_hdr * next_addr)
 {
-    btag * prev_blk_addr = get_prev_hdr_addr(blk_addr);
-    btag * next_blk_addr = get_next_hdr_addr(blk_addr);
-    size_t prev_alloc = get_alloc(prev_blk_addr);
-    size_t next_alloc = get_alloc(next_blk_addr);
-    size_t size = get_size(blk_addr);
-    btag * new_hdr_addr;
-    btag * new_ftr_addr;
-
-    // neighboring blocks are allocated
-    if (prev_alloc && next_alloc)
-    {
-        return blk_addr;
-    }
-    // previous block allocated, next free
-    else if (prev_alloc && !next_alloc)
-    {
-        remove_from_free_list((free_hdr *) next_blk_addr);
-        size += get_size(next_blk_addr);
-        new_hdr_addr = blk_addr;
-        new_ftr_addr = get_ftr_addr(next_blk_addr);
-    }
-    // previous block free, next allocated
-    else if (!prev_alloc && next_alloc)
-    {
-        remove_from_free_list((free_hdr *) prev_blk_addr);
-        size += get_size(prev_blk_addr);
-        new_hdr_addr = prev_blk_addr;
-        new_ftr_addr = get_ftr_addr(blk_addr);
-    }
-    // neighboring blocks are free
-    else
-    {
-        remove_from_free_list((free_hdr *) prev_blk_addr);
-        remove_from_free_list((free_hdr *) next_blk_addr);
-        size += get_size(prev_blk_addr) + get_size(next_blk_addr);
-        new_hdr_addr = prev_blk_addr;
-        new_ftr_addr = get_ftr_addr(next_blk_addr);
-    }
-
-    // update boundary tags
-    put_btag(new_hdr_addr, make_btag(size, 0));
-    put_btag(new_ftr_addr, make_btag(size, 0));
+    blk_addr->next_hdr_addr = encode_link(next_addr);
+}
 
-    return new_hdr_addr;
+/*
+ * prefetch_blk
+ *
+ * Starts loading the cache line of a block that is about to be read or relinked. Does nothing unless built with
+ * CACHE_LAYOUT.
+ * @param blk_addr address of block header (may be NULL)
+ */
+static inline void prefetch_blk(void * blk_addr)
+{
+#ifdef CACHE_LAYOUT
+    __builtin_prefetch(blk_addr, 1);
+#endif
 }
 
 /*
- * extend_heap
+ * get_free_lists_index
  *
- * Extends the heap by calling mem_sbrk function. The epilogue is updated and a new free block is added to the heap.
- * @param words words by which to extend heap (1 word = 4 bytes)
- * @return address of beginning of new heap memory
+ * Returns the appropriate free_lists index for a given size.
+ * @param size size of block
+ * @return index
  */
-static void * extend_heap(size_t words)
+static inline unsigned char get_free_lists_index(size_t size)
 {
-    char * new_mem;
-    size_t size;
+    size--;
 
-    // Allocate an even number of words to maintain alignment.
-    if (words % 2)
+    if (size < (0x1UL << SIZE_CLASS_MIN_POW))
     {
-        words++;
+        return 0;
     }
 
-    size = words * WORD_SIZE;
+    unsigned int pow = (sizeof(unsigned long) * CHAR_BIT - 1) - __builtin_clzl(size); // floor(log2(size))
 
-    if ((long) (new_mem = mem_sbrk(size)) == -1)
+    if (pow >= SIZE_CLASS_MAX_POW)
     {
-        return NULL;
+        return NUM_SIZE_CLASSES - 1;
     }
 
-    put_btag((char *) new_mem - WORD_SIZE + size, make_btag(0, 1)); // update epilogue
+    unsigned int sub = (size >> (pow - SIZE_CLASS_SUB_BITS)) & ((0x1 << SIZE_CLASS_SUB_BITS) - 1);
 
-    put_btag((char *) new_mem - WORD_SIZE, make_btag(size, 0)); // add header to new block
-    void * blk_addr = coalesce((btag *) ((char *) new_mem - WORD_SIZE));
-    size = get_size((btag *) blk_addr);
-    add_to_free_list(blk_addr, size); // add block to free list
+    return 1 + ((pow - SIZE_CLASS_MIN_POW) << SIZE_CLASS_SUB_BITS) + sub;
+}
 
-    return blk_addr;
+/*
+ * get_priority
+ *
+ * Returns the treap priority of a node, a multiplicative hash of its address.
+ * @param node tree node
+ * @return priority
+ */
+static inline unsigned int get_priority(tree_node * node)
+{
+    return (unsigned int) (((unsigned long) node * 0x9E3779B97F4A7C15UL) >> 32);
 }
 
 /*
- * mm_init
+ * is_tree_class
  *
- * Creates a heap with an initial free block.
- * @return 0 if successful, -1 if unsuccessful
+ * Returns whether a size class is kept in a treap rather than a list: the last class always, and every class under
+ * MM_FIT_ADDRESS, whose treaps are ordered by address alone so that freeing a block inserts it in logarithmic time.
+ * @param index size class
+ * @return nonzero for a treap
  */
-int mm_init(void)
+static inline int is_tree_class(unsigned char index)
+{
+    return (index == TREE_CLASS) || (fit_policy == MM_FIT_ADDRESS);
+}
+
+/*
+ * tree_less
+ *
+ * Compares two tree nodes of a size class: by size, breaking ties by address, in the last class, and by address
+ * alone in the others.
+ * @param index size class of the treap
+ * @param a first node
+ * @param b second node
+ * @return nonzero if a orders before b
+ */
+static inline int tree_less(unsigned char index, tree_node * a, tree_node * b)
 {
-    // Create initial empty heap
-    if ((heap_ptr = mem_sbrk(4 * WORD_SIZE)) == (void *) -1)
+    if (index != TREE_CLASS)
     {
-        return -1;
+        return a < b;
     }
 
-    put_val(heap_ptr, 0x0); // alignment padding
-    put_btag(heap_ptr + (1 * WORD_SIZE), make_btag(DWORD_SIZE, 1)); // prologue header
-    put_btag(heap_ptr + (2 * WORD_SIZE), make_btag(DWORD_SIZE, 1)); // prologue footer
-    put_btag(heap_ptr + (3 * WORD_SIZE), make_btag(0, 1)); // epilogue
-
-    heap_ptr += (3 * WORD_SIZE); // point to memory after prologue
+    size_t a_size = get_size(&(a->tag));
+    size_t b_size = get_size(&(b->tag));
 
-    // Initialize free lists
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
-    {
-        free_lists[i] = NULL;
-    }
+    return (a_size < b_size) || ((a_size == b_size) && (a < b));
+}
 
-    // Extend heap.
-    if (extend_heap(HEAP_EXT_SIZE / WORD_SIZE) == NULL)
-    {
-        return -1;
-    }
+/*
+ * rotate_right
+ *
+ * Rotates a subtree right, making the left child its root.
+ * @param node subtree root
+ * @return new subtree root
+ */
+static inline tree_node * rotate_right(tree_node * node)
+{
+    tree_node * left = get_prev_free(node);
+    set_prev_free(node, get_next_free(left));
+    set_next_free(left, node);
+    touch_block(node);
+    touch_block(left);
+    return left;
+}
 
-    return 0;
+/*
+ * rotate_left
+ *
+ * Rotates a subtree left, making the right child its root.
+ * @param node subtree root
+ * @return new subtree root
+ */
+static inline tree_node * rotate_left(tree_node * node)
+{
+    tree_node * right = get_next_free(node);
+    set_next_free(node, get_prev_free(right));
+    set_prev_free(right, node);
+    touch_block(node);
+    touch_block(right);
+    return right;
 }
 
 /*
- * find_fit
+ * tree_insert
  *
- * Finds a free block for allocation or extends heap to create one. The block is removed from its free list. Function is intended to be used in conjunction with allocate.
- * @param size size required
- * @return address of free block header
+ * Inserts a node into a treap, rotating it up while its priority exceeds its parent's. Left and right children are
+ * the previous and next free links.
+ * @param index size class of the treap
+ * @param root subtree root
+ * @param node node to insert (children must be NULL)
+ * @return new subtree root
  */
-static free_hdr * find_fit(size_t size)
+static tree_node * tree_insert(unsigned char index, tree_node * root, tree_node * node)
 {
-    unsigned char index = get_free_lists_index(size);
-    free_hdr * blk_addr;
+    if (root == NULL)
+    {
+        return node;
+    }
 
-    while (index < NUM_SIZE_CLASSES)
+    if (tree_less(index, node, root))
     {
-        blk_addr = free_lists[index];
-        while (blk_addr != NULL)
-        {
-            if (get_size(&(blk_addr->tag)) >= size)
-            {
-                remove_from_free_list(blk_addr);
-                return blk_addr;
-            }
+        set_prev_free(root, tree_insert(index, get_prev_free(root), node));
 
-            blk_addr = blk_addr->next_hdr_addr;
+        if (get_priority(get_prev_free(root)) > get_priority(root))
+        {
+            root = rotate_right(root);
         }
-
-        index++;
     }
+    else
+    {
+        set_next_free(root, tree_insert(index, get_next_free(root), node));
 
-    size_t ext_size = max(size, HEAP_EXT_SIZE);
-    extend_heap(ext_size / WORD_SIZE);
+        if (get_priority(get_next_free(root)) > get_priority(root))
+        {
+            root = rotate_left(root);
+        }
+    }
 
-    return find_fit(size);
+    return root;
 }
 
 /*
- * allocate
+ * tree_remove
  *
- * Allocate free block. Intended to be used in conjuction with find_fit.
- * @param blk_addr address of free block header
- * @param size required
+ * Removes a node from one of an arena's treaps. The node is found by its key and rotated down until it has at most
+ * one child, which then takes its place.
+ * @param ar arena owning the block
+ * @param index size class of the treap
+ * @param node node to remove
  */
-static void allocate(free_hdr * blk_addr, size_t size)
+static void tree_remove(arena * ar, unsigned char index, tree_node * node)
 {
-    size_t blk_size = get_size(&(blk_addr->tag));
+    tree_node * parent = NULL;
+    tree_node * child = ar->free_lists[index];
 
-    if ((blk_size - size) >= MIN_BLK_SIZE)
+    while (child != node)
     {
-        // Split block
-        btag new_btag = make_btag(size, 1);
-        put_btag(blk_addr, new_btag); // update header
-        put_btag(get_ftr_addr((btag *) blk_addr), new_btag); // add new footer
+#ifdef HARDENED
+        if (child == NULL)
+        {
+            report_corruption("corrupted free tree", (char *) node + WORD_SIZE);
+        }
+#endif
 
-        blk_addr = get_next_hdr_addr((btag *) blk_addr);
-        add_to_free_list(blk_addr, blk_size - size); // add fragment to free list
+        parent = child;
+        child = tree_less(index, node, child) ? get_prev_free(child) : get_next_free(child);
     }
-    else
+
+    while (1)
+    {
+        tree_node * left = get_prev_free(node);
+        tree_node * right = get_next_free(node);
+
+        if ((left == NULL) || (right == NULL))
+        {
+            child = (left != NULL) ? left : right;
+        }
+        else if (get_priority(left) > get_priority(right))
+        {
+            child = rotate_right(node);
+        }
+        else
+        {
+            child = rotate_left(node);
+        }
+
+        // Link child (the new root of the subtree) to parent
+        if (parent == NULL)
+        {
+            ar->free_lists[index] = child;
+        }
+        else if (tree_less(index, node, parent))
+        {
+            set_prev_free(parent, child);
+            touch_block(parent);
+        }
+        else
+        {
+            set_next_free(parent, child);
+            touch_block(parent);
+        }
+
+        if ((left == NULL) || (right == NULL))
+        {
+            break;
+        }
+
+        parent = child; // node moved one level down
+    }
+
+    if (ar->free_lists[index] == NULL)
     {
-        btag new_btag = make_btag(blk_size, 1);
-        put_btag(blk_addr, new_btag); // update header
-        put_btag(get_ftr_addr((btag *) blk_addr), new_btag); // update footer
+        ar->nonempty &= ~(0x1UL << index);
     }
 }
 
 /*
- * mm_malloc
+ * tree_best_fit
  *
- * Allocates a block from the free list.
- * @param size number of bytes requested
- * @return address of allocated block
+ * Finds the smallest block in an arena's treap that can hold a given size.
+ * @param ar arena to search
+ * @param size size required
+ * @return address of best fitting block header, or NULL if no block is large enough
  */
-void * malloc(size_t size)
+static tree_node * tree_best_fit(arena * ar, size_t size)
 {
-    size_t adj_size; // adjusted size to include overhead and satisfy alignment
-    
-    // Ignore spurious requests
-    if ((size == 0) || (size > MAX_BLK_SIZE))
-    {
-        return NULL;
-    }
+    tree_node * node = ar->free_lists[TREE_CLASS];
+    tree_node * best = NULL;
 
-    // Adjust block size to include overhead and satisfy alignment
-    if (size <= 2 * DWORD_SIZE)
-    {
-        adj_size = MIN_BLK_SIZE;
-    }
-    else
+    while (node != NULL)
     {
-        adj_size = DWORD_SIZE * ((size + DWORD_SIZE + (DWORD_SIZE - 1)) / DWORD_SIZE);
+        if (get_size(&(node->tag)) >= size)
+        {
+            best = node;
+            node = get_prev_free(node);
+        }
+        else
+        {
+            node = get_next_free(node);
+        }
     }
 
-    free_hdr * blk_addr = find_fit(adj_size);
-    allocate(blk_addr, adj_size);
-    return (char *) blk_addr + WORD_SIZE; // return address for data storage
+    return best;
 }
 
 /*
- * mm_free
+ * tree_first_fit
  *
- * Frees a block.
- * @param ptr address of block to free
+ * Finds the lowest addressed block that can hold a given size in an address ordered treap, visiting nodes in address
+ * order. When every block fits this only descends to the leftmost node.
+ * @param ar arena owning the treap
+ * @param node subtree root
+ * @param size size required
+ * @return address of first fitting block header, or NULL if no block is large enough
  */
-void free(void * ptr)
+static tree_node * tree_first_fit(arena * ar, tree_node * node, size_t size)
 {
-    if (ptr == NULL)
+    while (node != NULL)
     {
-        return;
+        tree_node * found = tree_first_fit(ar, get_prev_free(node), size);
+
+        if (found != NULL)
+        {
+            return found;
+        }
+
+        ar->stats.fit_scans++;
+
+        if (get_size(&(node->tag)) >= size)
+        {
+            return node;
+        }
+
+        node = get_next_free(node);
     }
 
-    void * blk_addr = coalesce((btag *) ((char *) ptr - WORD_SIZE));
-    size_t size = get_size((btag *) blk_addr);
-    add_to_free_list(blk_addr, size);
+    return NULL;
 }
 
 /*
- * mm_realloc
+ * add_to_free_list
  *
- * Reallocates memory stored in one block to another (typically of greater capacity). If a size smaller than the original size is given, the memory will be reallocated but not resized.
- * @param old_ptr old memory pointer
- * @param size needed for data storage
+ * Add block to beginning of free list, or to the treap for its size class (the last class, or any under MM_FIT_ADDRESS). The block does not need a header or footer for this function.
+ * The previous block must be allocated (free blocks are always coalesced); the next block is marked as following a free block.
+ * @param ar arena owning the block
+ * @param mem_addr address of block
+ * @param size size of block
  */
-void * realloc(void * old_ptr, size_t size)
+static void add_to_free_list(arena * ar, void * mem_addr, size_t size)
 {
-    if (size == 0)
-    {
-        free(old_ptr);
-        return NULL;
-    }
+    btag new_btag = make_btag(size, PREV_ALLOC);
+    unsigned char index = get_free_lists_index(size);
 
-    if (old_ptr == NULL)
+    set_prev_alloc((btag *) ((char *) mem_addr + size), 0);
+    touch_block(mem_addr);
+
+    if (is_tree_class(index))
     {
-        return malloc(size);
+        put_free_hdr(mem_addr, make_free_hdr(new_btag, NULL, NULL)); // rewrite header with no children
+        put_btag(get_ftr_addr(mem_addr), new_btag); // rewrite footer
+
+        ar->free_lists[index] = (free_hdr *) tree_insert(index, ar->free_lists[index], mem_addr);
+        ar->nonempty |= (0x1UL << index);
+        return;
     }
 
-    size_t old_size = get_size((btag *) ((char *) old_ptr - WORD_SIZE)) - DWORD_SIZE; // size usable for data storage
-    size = max(old_size, size); // prevent realloc to smaller block
+    free_hdr new_free_hdr = make_free_hdr(new_btag, NULL, ar->free_lists[index]);
 
-    void * new_ptr = malloc(size);
+    put_free_hdr(mem_addr, new_free_hdr); // rewrite header
+    put_btag(get_ftr_addr(mem_addr), new_btag); // rewrite footer
 
-    if (!new_ptr)
+    ar->free_lists[index] = mem_addr; // insert at beginning of free list
+    ar->nonempty |= (0x1UL << index);
+
+    // Update prev_hdr_addr of next block
+    if (get_next_free(ar->free_lists[index]) != NULL)
     {
-        return NULL;
+        set_prev_free(get_next_free(ar->free_lists[index]), ar->free_lists[index]);
+        touch_block(get_next_free(ar->free_lists[index]));
     }
-
-    memcpy(new_ptr, old_ptr, old_size); // copy contents to new block
-    free(old_ptr); // free old block
-
-    return new_ptr;
 }
 
+#ifdef HARDENED
 /*
- * mm_calloc
+ * is_heap_addr
  *
- * Allocate block and set contents to zero.
- * @param num_elems number of elements
- * @param elem_size size of elements
- * @return block pointer
+ * Checks whether an address lies in the heap, so that a link read from a block can be followed safely.
+ * @param mem_addr address
+ * @return nonzero if the address is in the heap
  */
-void * calloc(size_t num_elems, size_t elem_size)
+static inline int is_heap_addr(void * mem_addr)
 {
-    size_t bytes = num_elems * elem_size;
-    void * new_ptr = malloc(bytes);
-    memset(new_ptr, 0, bytes);
-
-    return new_ptr;
+    return ((char *) mem_addr >= (char *) heap_lo) && ((char *) mem_addr < (char *) mem_heap_hi());
 }
+#endif
 
 /*
- * mm_checkheap
+ * remove_from_free_list
  *
- * Checks the heap for correctness. Exits when an error is detected.
- * @param verbose level of checking involved (not utilized)
+ * Remove block from free list (or treap) and updates list.
+ * @param ar arena owning the block
+ * @param blk_addr address of block header
  */
-#ifdef DEBUG
-void mm_checkheap(int verbose)
+static void remove_from_free_list(arena * ar, free_hdr * blk_addr)
 {
-    // Check prologue
-    if (* (unsigned int *) ((char *) heap_ptr - DWORD_SIZE) != 9)
-    {
-        dbg_printf("Invalid prologue header.\n");
-        exit(1);
-    }
+    unsigned char index = get_free_lists_index(get_size(&(blk_addr->tag)));
 
-    if (* (unsigned int *) ((char *) heap_ptr - WORD_SIZE) != 9)
+    if (is_tree_class(index))
     {
-        dbg_printf("Invalid prologue footer.\n");
-        exit(1);
+        tree_remove(ar, index, blk_addr);
+        return;
     }
 
-    // Check blocks and epilogue
-    size_t num_free_blks[NUM_SIZE_CLASSES];
+    free_hdr * prev_addr = get_prev_free(blk_addr);
+    free_hdr * next_addr = get_next_free(blk_addr);
 
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    if (ar->rover == blk_addr)
     {
-        num_free_blks[i] = 0;
+        ar->rover = next_addr; // next fit resumes after the block
     }
 
-    btag * blk_ptr = (btag *) heap_ptr;
-
-    while (!((get_size(blk_ptr) == 0) && (get_alloc(blk_ptr) == 1))) // stop at epilogue
+#ifdef HARDENED
+    // Safe unlinking: the neighbors must lie in the heap and link back to the block
+    if (((prev_addr == NULL) && (ar->free_lists[index] != blk_addr)) ||
+        ((prev_addr != NULL) && (!is_heap_addr(prev_addr) || (get_next_free(prev_addr) != blk_addr))) ||
+        ((next_addr != NULL) && (!is_heap_addr(next_addr) || (get_prev_free(next_addr) != blk_addr))))
     {
-        size_t size = get_size(blk_ptr);
-        size_t alloc = get_alloc(blk_ptr);
-        void * ftr_addr = get_ftr_addr(blk_ptr);
-
-        if ((get_size((btag *) ftr_addr) != size) && (get_alloc((btag *) ftr_addr) != alloc))
-        {
-            dbg_printf("Block header and footer do not agree at block address %p.\n", blk_ptr);
-            exit(1);
-        }
-
-        if (alloc == 0)
-        {
-            num_free_blks[get_free_lists_index(size)]++;
-        }
-
-        blk_ptr = get_next_hdr_addr(blk_ptr);
+        report_corruption("corrupted free list", (char *) blk_addr + WORD_SIZE);
     }
+#endif
 
-    // Check free lists
-    unsigned char index = 0;
-    while (index < NUM_SIZE_CLASSES)
+    if (prev_addr == NULL)
+    // first block in list
     {
-        free_hdr * free_blk_ptr = free_lists[index];
-        size_t blk_count = 0;
+        // Update free list pointer
+        ar->free_lists[index] = next_addr;
 
-        while (free_blk_ptr != NULL)
+        if (ar->free_lists[index] == NULL)
         {
-            blk_count++;
-            free_blk_ptr = free_blk_ptr->next_hdr_addr;
+            ar->nonempty &= ~(0x1UL << index);
         }
-
-        if (blk_count != num_free_blks[index])
+    }
+    else
+    // block not first
+    {
+        // Update next_hdr_addr of previous block
+        set_next_free(prev_addr, next_addr);
+        touch_block(prev_addr);
+    }
+    
+    // Update prev_hdr_addr of next block
+    if (next_addr != NULL)
+    {
+        set_prev_free(next_addr, prev_addr);
+        touch_block(next_addr);
+    }
+}
+
+/*
+ * coalesce
+ *
+ * Checks neighboring blocks of free block (or block intended to be freed) and combines contiguous free blocks if found.
+ * @param ar arena owning the block
+ * @param blk_addr address of block header
+ * @return new block header address
+ */
+static void * coalesce(arena * ar, btag * blk_addr)
+{
+    btag * next_blk_addr = get_next_hdr_addr(blk_addr);
+    size_t prev_alloc = get_prev_alloc(blk_addr);
+    size_t next_alloc = get_alloc(next_blk_addr);
+    size_t size = get_size(blk_addr);
+    btag * new_hdr_addr;
+    btag * new_ftr_addr;
+
+#ifdef CACHE_LAYOUT
+    // Start loading the blocks unlinking will write before any of them is needed
+    if (!next_alloc)
+    {
+        prefetch_blk(get_prev_free((free_hdr *) next_blk_addr));
+        prefetch_blk(get_next_free((free_hdr *) next_blk_addr));
+    }
+
+    if (!prev_alloc)
+    {
+        prefetch_blk(get_prev_hdr_addr(blk_addr));
+    }
+#endif
+
+    // neighboring blocks are allocated
+    if (prev_alloc && next_alloc)
+    {
+        return blk_addr;
+    }
+    // previous block allocated, next free
+    else if (prev_alloc && !next_alloc)
+    {
+        remove_from_free_list(ar, (free_hdr *) next_blk_addr);
+        size += get_size(next_blk_addr);
+        new_hdr_addr = blk_addr;
+        new_ftr_addr = get_ftr_addr(next_blk_addr);
+        ar->stats.coalesces++;
+    }
+    // previous block free, next allocated
+    else if (!prev_alloc && next_alloc)
+    {
+        btag * prev_blk_addr = get_prev_hdr_addr(blk_addr);
+        remove_from_free_list(ar, (free_hdr *) prev_blk_addr);
+        size += get_size(prev_blk_addr);
+        new_hdr_addr = prev_blk_addr;
+        new_ftr_addr = get_ftr_addr(blk_addr);
+        ar->stats.coalesces++;
+    }
+    // neighboring blocks are free
+    else
+    {
+        btag * prev_blk_addr = get_prev_hdr_addr(blk_addr);
+        remove_from_free_list(ar, (free_hdr *) prev_blk_addr);
+        remove_from_free_list(ar, (free_hdr *) next_blk_addr);
+        size += get_size(prev_blk_addr) + get_size(next_blk_addr);
+        new_hdr_addr = prev_blk_addr;
+        new_ftr_addr = get_ftr_addr(next_blk_addr);
+        ar->stats.coalesces += 2;
+    }
+
+    // update boundary tags
+    put_btag(new_hdr_addr, make_btag(size, PREV_ALLOC));
+    put_btag(new_ftr_addr, make_btag(size, 0));
+
+    // Headers of merged blocks are gone
+    if (!next_alloc)
+    {
+        untouch_block(next_blk_addr);
+    }
+
+    if (new_hdr_addr != blk_addr)
+    {
+        untouch_block(blk_addr);
+    }
+
+    return new_hdr_addr;
+}
+
+/*
+ * get_heap_granularity
+ *
+ * Returns the unit in which the heap grows and shrinks: a page, an arena unit when there are several arenas, or a
+ * huge page when memlib backs the heap with huge pages, so that no huge page is split by trimming or shared by two
+ * arenas.
+ * @return granularity in bytes
+ */
+static inline size_t get_heap_granularity(void)
+{
+    size_t granularity = mem_heap_pagesize();
+
+    if ((num_arenas > 1) && (granularity < ARENA_UNIT_SIZE))
+    {
+        granularity = ARENA_UNIT_SIZE;
+    }
+
+    return granularity;
+}
+
+/*
+ * lock_sbrk
+ *
+ * Serializes heap growth between arenas in thread-safe mode.
+ */
+static inline void lock_sbrk(void)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&sbrk_lock);
+#endif
+}
+
+/*
+ * unlock_sbrk
+ *
+ * Releases the heap growth lock in thread-safe mode.
+ */
+static inline void unlock_sbrk(void)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&sbrk_lock);
+#endif
+}
+
+/*
+ * start_segment
+ *
+ * Starts a new heap segment for an arena in the first four words of memory just obtained from mem_sbrk. The
+ * segment begins with alignment padding and a prologue block and ends with an epilogue.
+ * @param ar arena
+ * @param seg_addr address of new memory
+ */
+static void start_segment(arena * ar, char * seg_addr)
+{
+    put_val(seg_addr, 0x0); // alignment padding
+    put_btag(seg_addr + (1 * WORD_SIZE), make_btag(DWORD_SIZE, 1)); // prologue header
+    put_btag(seg_addr + (2 * WORD_SIZE), make_btag(DWORD_SIZE, 1)); // prologue footer
+    put_btag(seg_addr + (3 * WORD_SIZE), make_btag(0, ALLOC | PREV_ALLOC)); // epilogue
+
+    ar->epilogue = (btag *) (seg_addr + (3 * WORD_SIZE));
+}
+
+/*
+ * extend_heap
+ *
+ * Extends the heap by calling mem_sbrk function. The arena's newest segment grows in place if it is at the top of
+ * the heap and stays within MAX_SEG_SIZE; otherwise a new segment is started. The heap grows by at least the
+ * requested size, up to a whole number of heap granules (see get_heap_granularity). The epilogue is updated and a
+ * new free block is added to the heap.
+ * @param ar arena to extend
+ * @param words words by which to extend heap (1 word = 4 bytes)
+ * @return address of beginning of new heap memory
+ */
+static void * extend_heap(arena * ar, size_t words)
+{
+    char * new_mem;
+    size_t size;
+
+    // Allocate an even number of words to maintain alignment.
+    if (words % 2)
+    {
+        words++;
+    }
+
+    size = words * WORD_SIZE;
+
+    lock_sbrk();
+
+    size_t heap_size = mem_heapsize();
+    char * mem_fresh = mem_heap_fresh();
+    size_t granularity = get_heap_granularity();
+    int new_segment = ((char *) ar->epilogue + WORD_SIZE != (char *) heap_lo + heap_size) ||
+                      (ar->seg_size + size + granularity > MAX_SEG_SIZE);
+    size_t seg_overhead = new_segment ? (4 * WORD_SIZE) : 0;
+
+    // Grow by whole units when there are several arenas so that no unit is shared by two arenas
+    size_t new_heap_size = (heap_size + seg_overhead + size + granularity - 1) & ~(granularity - 1);
+    size = new_heap_size - heap_size - seg_overhead;
+
+    // The segment is only laid out once the memory for it is obtained, so that a failure leaves the arena as it was
+    if ((long) (new_mem = mem_sbrk(seg_overhead + size)) == -1)
+    {
+        unlock_sbrk();
+        return NULL;
+    }
+
+    if (new_segment)
+    {
+        start_segment(ar, new_mem);
+        new_mem += seg_overhead;
+    }
+
+    if (num_arenas > 1)
+    {
+        for (size_t unit = heap_size >> ARENA_UNIT_SHIFT; unit < (mem_heapsize() >> ARENA_UNIT_SHIFT); unit++)
+        {
+            arena_map[unit] = ar - arenas;
+        }
+    }
+
+    unlock_sbrk();
+
+    ar->heap_size += seg_overhead + size;
+    ar->heap_peak = (ar->heap_size > ar->heap_peak) ? ar->heap_size : ar->heap_peak;
+
+    ar->seg_size = (new_segment ? 0 : ar->seg_size) + size;
+    ar->stats.extends++;
+
+    btag * old_epilogue = ar->epilogue;
+    put_btag(old_epilogue, make_btag(size, get_prev_alloc(old_epilogue))); // add header to new block
+
+    ar->epilogue = (btag *) ((char *) new_mem - WORD_SIZE + size);
+    put_btag(ar->epilogue, make_btag(0, ALLOC)); // update epilogue
+
+    void * blk_addr = coalesce(ar, (btag *) ((char *) new_mem - WORD_SIZE));
+
+    // Unless memlib handed them out before, the new bytes are zero. If they join a free block whose zero bytes
+    // reach its footer, clearing the old footer and epilogue makes them one run; otherwise the run restarts.
+    char * fresh = (mem_fresh > new_mem) ? mem_fresh : new_mem;
+
+    if ((blk_addr != old_epilogue) && (fresh == new_mem) && (ar->fresh <= (char *) old_epilogue - WORD_SIZE))
+    {
+        put_val((char *) old_epilogue - WORD_SIZE, 0x0);
+        put_val(old_epilogue, 0x0);
+    }
+    else
+    {
+        char * links_end = (char *) old_epilogue + sizeof(free_hdr); // past the new block's header and links
+
+        ar->fresh = (fresh > links_end) ? fresh : links_end;
+    }
+
+    size = get_size((btag *) blk_addr);
+    add_to_free_list(ar, blk_addr, size); // add block to free list
+
+    return blk_addr;
+}
+
+/*
+ * trim_heap
+ *
+ * Returns free space at the top of the heap to the system. The free block must be the last block of the arena's
+ * newest segment, which must be at the top of the heap. trim_threshold bytes are kept free, as glibc keeps
+ * M_TOP_PAD, so that a heap that shrinks and grows a little does not give back and refault the same pages each
+ * time, and the heap stays a whole number of heap granules. The arena lock must be held.
+ * @param ar arena owning the block
+ * @param blk_addr address of free block header
+ */
+static void trim_heap(arena * ar, btag * blk_addr)
+{
+    lock_sbrk();
+
+    size_t heap_size = mem_heapsize();
+
+    if ((char *) ar->epilogue + WORD_SIZE != (char *) heap_lo + heap_size)
+    {
+        unlock_sbrk(); // another arena's segment is above
+        return;
+    }
+
+    size_t size = get_size(blk_addr);
+    size_t granularity = get_heap_granularity();
+    size_t new_heap_size = (heap_size - size + trim_threshold + granularity - 1) & ~(granularity - 1);
+
+    if (new_heap_size >= heap_size)
+    {
+        unlock_sbrk();
+        return;
+    }
+
+    size_t release = heap_size - new_heap_size;
+
+    remove_from_free_list(ar, (free_hdr *) blk_addr);
+    mem_sbrk(-(intptr_t) release);
+    ar->heap_size -= release;
+    ar->seg_size -= release;
+    ar->stats.trims++;
+
+    ar->epilogue = (btag *) ((char *) heap_lo + new_heap_size - WORD_SIZE);
+    put_btag(ar->epilogue, make_btag(0, ALLOC)); // update epilogue
+    add_to_free_list(ar, blk_addr, size - release);
+
+    unlock_sbrk();
+}
+
+/*
+ * mm_init_arenas
+ *
+ * Creates a heap split into a number of independent arenas. The first arena starts with an initial free block;
+ * the others grow on first use.
+ * @param count number of arenas (1 to MAX_ARENAS)
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int mm_init_arenas(unsigned int count)
+{
+    if ((count < 1) || (count > MAX_ARENAS))
+    {
+        return -1;
+    }
+
+    num_arenas = count;
+    heap_lo = mem_heap_lo();
+
+#ifdef HARDENED
+    canary_secret = ((unsigned int) ((uintptr_t) &count >> 4) ^ (unsigned int) time(NULL)) * 2654435761U;
+#endif
+
+    // Initialize arenas
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        for (int j = 0; j < NUM_SIZE_CLASSES; j++)
+        {
+            arenas[i].free_lists[j] = NULL;
+        }
+
+        arenas[i].nonempty = 0x0;
+        arenas[i].rover = NULL;
+
+        arenas[i].epilogue = NULL;
+        arenas[i].heap_size = 0;
+        arenas[i].heap_peak = 0;
+        arenas[i].seg_size = 0;
+        arenas[i].fresh = NULL;
+        arenas[i].ext_size = HEAP_EXT_SIZE;
+        arenas[i].fits_since_ext = 0;
+        memset(&arenas[i].stats, 0, sizeof(arena_stats));
+
+        for (int j = 0; j < QUICK_NUM_BINS; j++)
+        {
+            arenas[i].quick_lists[j] = NULL;
+        }
+
+        arenas[i].quick_count = 0;
+#ifdef SLAB_ALLOC
+        for (int j = 0; j < SLAB_NUM_CLASSES; j++)
+        {
+            arenas[i].slabs[j] = NULL;
+            arenas[i].slab_demand[j] = 0;
+        }
+#endif
+#ifdef THREAD_SAFE
+        pthread_mutex_init(&arenas[i].lock, NULL);
+#endif
+    }
+
+#ifdef THREAD_SAFE
+    pthread_once(&tcache_key_once, tcache_create_key);
+    heap_id++; // blocks cached by any thread now belong to a discarded heap
+#endif
+#ifdef SLAB_ALLOC
+    memset(slab_page_map, 0, (mem_max_heap() / SLAB_RUN_SIZE / 64 + 1) * sizeof(unsigned long)); // pages in reach
+#endif
+#ifdef HEAP_PROFILE
+    profile_reset(); // samples refer to the discarded heap
+#endif
+#ifdef DEBUG
+    num_touched = 0;
+    touch_overflow = 0;
+#endif
+
+    // Create initial heap, one extension including the first segment's padding, prologue and epilogue
+    if (extend_heap(&arenas[0], (HEAP_EXT_SIZE - (4 * WORD_SIZE)) / WORD_SIZE) == NULL)
+    {
+        return -1;
+    }
+
+    heap_ptr = (char *) heap_lo + (3 * WORD_SIZE); // point to memory after prologue
+
+    return 0;
+}
+
+/*
+ * mm_init
+ *
+ * Creates a heap with an initial free block. In thread-safe mode the heap has one arena per online CPU (up to
+ * MAX_ARENAS); otherwise it has a single arena.
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int mm_init(void)
+{
+    unsigned int count = 1;
+
+#ifdef THREAD_SAFE
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_cpus > 1)
+    {
+        count = (num_cpus < MAX_ARENAS) ? num_cpus : MAX_ARENAS;
+    }
+#endif
+
+    return mm_init_arenas(count);
+}
+
+/*
+ * grow_heap
+ *
+ * Extends the heap by at least the given size. The extension grows geometrically while the arena keeps missing
+ * within HEAP_EXT_WINDOW find_fit calls of the previous extension, bounded by HEAP_EXT_MAX and by 1/2^HEAP_EXT_SHIFT
+ * of the arena's largest heap so that a small heap is not padded out, and shrinks back when misses become rare. The
+ * bound uses the largest heap rather than the current one so that a trim does not reset the extension size. The
+ * arena lock must be held.
+ * @param ar arena to extend
+ * @param size bytes of new memory required (at least MIN_BLK_SIZE)
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int grow_heap(arena * ar, size_t size)
+{
+    size_t limit = ar->heap_peak >> HEAP_EXT_SHIFT;
+
+    if (limit > HEAP_EXT_MAX)
+    {
+        limit = HEAP_EXT_MAX;
+    }
+
+    if (ar->fits_since_ext < HEAP_EXT_WINDOW)
+    {
+        if ((ar->ext_size * 2) <= limit)
+        {
+            ar->ext_size *= 2;
+        }
+    }
+    else if (ar->ext_size > HEAP_EXT_SIZE)
+    {
+        ar->ext_size /= 2;
+    }
+
+    ar->fits_since_ext = 0;
+
+    size_t ext_size = (size > ar->ext_size) ? size : ar->ext_size;
+
+    return (extend_heap(ar, ext_size / WORD_SIZE) == NULL) ? -1 : 0;
+}
+
+/*
+ * search_list
+ *
+ * Searches one size class list for a block of at least the given size under the fit policy: the first fit from the
+ * head for MM_FIT_LIFO, the lowest addressed fit in the class's treap for MM_FIT_ADDRESS, the first fit from the
+ * rover (wrapping around to it) for MM_FIT_NEXT, and the smallest fit for MM_FIT_BEST. Under MM_FIT_NEXT the rover is left on the block found, so that removing
+ * it moves the rover on to the following block.
+ * @param ar arena to search
+ * @param index size class (not TREE_CLASS)
+ * @param size size required
+ * @return address of free block header, or NULL if no block in the list fits
+ */
+static free_hdr * search_list(arena * ar, unsigned char index, size_t size)
+{
+    free_hdr * start = ar->free_lists[index];
+    free_hdr * best = NULL;
+
+    if (fit_policy == MM_FIT_ADDRESS)
+    {
+        return tree_first_fit(ar, start, size);
+    }
+
+    if ((fit_policy == MM_FIT_NEXT) && (ar->rover != NULL) &&
+        (get_free_lists_index(get_size(&(ar->rover->tag))) == index))
+    {
+        start = ar->rover;
+    }
+
+    free_hdr * blk_addr = start;
+
+    while (blk_addr != NULL)
+    {
+        size_t blk_size = get_size(&(blk_addr->tag));
+
+        prefetch_blk(get_next_free(blk_addr)); // load the next node while this one is examined
+        ar->stats.fit_scans++;
+
+        if (blk_size >= size)
+        {
+            if (fit_policy != MM_FIT_BEST)
+            {
+                best = blk_addr;
+                break;
+            }
+
+            if ((best == NULL) || (blk_size < get_size(&(best->tag))))
+            {
+                best = blk_addr;
+
+                if (blk_size == size)
+                {
+                    break; // exact fit
+                }
+            }
+        }
+
+        blk_addr = get_next_free(blk_addr);
+
+        if (blk_addr == NULL)
+        {
+            blk_addr = ar->free_lists[index]; // wrap around to the blocks before the rover
+        }
+
+        if (blk_addr == start)
+        {
+            break;
+        }
+    }
+
+    if ((fit_policy == MM_FIT_NEXT) && (best != NULL))
+    {
+        ar->rover = best;
+    }
+
+    return best;
+}
+
+/*
+ * find_fit
+ *
+ * Finds a free block for allocation or extends heap to create one. The block is removed from its free list. Function is intended to be used in conjunction with allocate.
+ * Only the request's own size class needs a first fit search, and not even that when the request is the smallest
+ * block size of the class, except for best fit. Any block in a larger class fits, so the first non-empty larger class
+ * is found directly from the bitmap; its head is taken, or the block address order, next fit or best fit picks
+ * from it. The last size class is searched best fit through its treap. On a miss, deferred blocks are coalesced or
+ * the heap is grown and the search repeated.
+ * @param ar arena to allocate from
+ * @param size size required
+ * @return address of free block header, or NULL if the heap cannot grow
+ */
+static free_hdr * find_fit(arena * ar, size_t size)
+{
+    unsigned char index = get_free_lists_index(size);
+
+    ar->fits_since_ext++;
+    ar->stats.fit_calls++;
+
+    for (;;)
+    {
+        free_hdr * blk_addr = ar->free_lists[index];
+
+        if (index == TREE_CLASS)
+        {
+            blk_addr = tree_best_fit(ar, size);
+            if (blk_addr != NULL)
+            {
+                tree_remove(ar, TREE_CLASS, blk_addr);
+                return blk_addr;
+            }
+        }
+        else if ((blk_addr != NULL) && (size <= size_class_min_blk[index]) && (fit_policy != MM_FIT_BEST))
+        {
+            if ((fit_policy == MM_FIT_NEXT) || (fit_policy == MM_FIT_ADDRESS))
+            {
+                blk_addr = search_list(ar, index, size); // every block fits, so this takes the rover or lowest block
+            }
+
+            remove_from_free_list(ar, blk_addr);
+            return blk_addr;
+        }
+        else if (blk_addr != NULL)
+        {
+            blk_addr = search_list(ar, index, size);
+            if (blk_addr != NULL)
+            {
+                remove_from_free_list(ar, blk_addr);
+                return blk_addr;
+            }
+        }
+
+        unsigned long larger = ar->nonempty & (~0x1UL << index); // non-empty classes above index
+
+        if (larger != 0x0)
+        {
+            blk_addr = ar->free_lists[__builtin_ctzl(larger)];
+
+            if ((get_next_hdr_addr(&(blk_addr->tag)) == ar->epilogue) && (get_next_free(blk_addr) == NULL) &&
+                (get_prev_free(blk_addr) == NULL) && ((larger & (larger - 1)) != 0x0) &&
+                (__builtin_ctzl(larger) != TREE_CLASS))
+            {
+                // Keep the free last block for growing blocks in place while another class can serve the request
+                larger &= larger - 1;
+                blk_addr = ar->free_lists[__builtin_ctzl(larger)];
+            }
+
+            if (__builtin_ctzl(larger) == TREE_CLASS)
+            {
+                blk_addr = tree_best_fit(ar, size); // smallest block in treap
+            }
+            else if (fit_policy != MM_FIT_LIFO)
+            {
+                blk_addr = search_list(ar, __builtin_ctzl(larger), size);
+            }
+
+            remove_from_free_list(ar, blk_addr);
+            return blk_addr;
+        }
+
+        if (ar->quick_count > 0)
+        {
+            quick_sweep(ar); // coalescing deferred blocks may produce a fit
+        }
+        else
+        {
+            size_t shortfall = size;
+
+            if ((ar->epilogue != NULL) && !get_prev_alloc(ar->epilogue))
+            {
+                // The new memory is coalesced with the free last block
+                shortfall = max(size - get_size((btag *) ((char *) ar->epilogue - WORD_SIZE)), MIN_BLK_SIZE);
+            }
+
+            if (grow_heap(ar, shortfall) == -1)
+            {
+                return NULL;
+            }
+        }
+    }
+}
+
+/*
+ * claim_fresh
+ *
+ * Keeps track of the heap that has not been written since memlib handed it out. Bytes from the arena's fresh
+ * boundary up to the footer of the last block of its newest segment are zero, so the boundary moves past every
+ * block handed out, and past the header and links a free remainder after it is given. Blocks below it were used
+ * or hold free list links, so calloc must clear them.
+ * @param ar arena owning the block
+ * @param end address just past the block
+ */
+static inline void claim_fresh(arena * ar, char * end)
+{
+    if (end + sizeof(free_hdr) > ar->fresh)
+    {
+        ar->fresh = end + sizeof(free_hdr);
+    }
+}
+
+/*
+ * allocate
+ *
+ * Allocate free block. Intended to be used in conjuction with find_fit.
+ * @param ar arena owning the block
+ * @param blk_addr address of free block header
+ * @param size required
+ */
+static void allocate(arena * ar, free_hdr * blk_addr, size_t size)
+{
+    size_t blk_size = get_size(&(blk_addr->tag));
+    char * end = (char *) blk_addr + size;
+
+    touch_block(blk_addr);
+
+    if ((blk_size - size) >= MIN_BLK_SIZE)
+    {
+        // Split block
+        put_btag(blk_addr, make_btag(size, ALLOC | PREV_ALLOC)); // update header
+
+        blk_addr = get_next_hdr_addr((btag *) blk_addr);
+        add_to_free_list(ar, blk_addr, blk_size - size); // add fragment to free list
+        ar->stats.splits++;
+    }
+    else
+    {
+        put_btag(blk_addr, make_btag(blk_size, ALLOC | PREV_ALLOC)); // update header
+        set_prev_alloc(get_next_hdr_addr((btag *) blk_addr), 1);
+
+        end = (char *) blk_addr + blk_size;
+
+        if (end - WORD_SIZE >= ar->fresh)
+        {
+            put_val(end - WORD_SIZE, 0x0); // the old footer is the one word written past the fresh boundary
+        }
+    }
+
+    claim_fresh(ar, end);
+}
+
+/*
+ * free_block
+ *
+ * Returns an allocated block to the free lists, coalescing it with its neighbors. A free block at the end of the
+ * arena's newest segment is trimmed once it reaches twice trim_threshold, so that a trim keeps trim_threshold
+ * bytes and releases at least as many. The arena lock must be held.
+ * @param ar arena owning the block
+ * @param blk_addr address of block header
+ */
+static void free_block(arena * ar, btag * blk_addr)
+{
+    void * new_blk_addr = coalesce(ar, blk_addr);
+    size_t size = get_size((btag *) new_blk_addr);
+    add_to_free_list(ar, new_blk_addr, size);
+
+    if ((trim_threshold != 0) && (size >= 2 * trim_threshold) &&
+        (get_next_hdr_addr(new_blk_addr) == ar->epilogue))
+    {
+        trim_heap(ar, new_blk_addr);
+    }
+}
+
+/*
+ * get_region_size
+ *
+ * Returns the size of the region of a block allocated by map_block.
+ * @param blk_addr address of block header
+ * @return region size
+ */
+static inline size_t get_region_size(btag * blk_addr)
+{
+    return * (size_t *) ((char *) blk_addr - MMAP_PAD);
+}
+
+/*
+ * use_mapping
+ *
+ * Returns nonzero if a block of the given size is to get a region of its own: it is at least mmap_threshold, or
+ * too large for a heap block's tags.
+ * @param size block size required
+ * @return nonzero to map the block
+ */
+static inline int use_mapping(size_t size)
+{
+    return (size > MAX_BLK_SIZE) || ((mmap_threshold != 0) && (size >= mmap_threshold));
+}
+
+/*
+ * map_block
+ *
+ * Allocates a block in a region of its own from mem_map. The region size is kept in the first word of the region,
+ * as it may not fit the header, which records only the MMAPPED bit; the region starts MMAP_PAD bytes before the
+ * header so that the payload is aligned.
+ * @param size block size required
+ * @return address of block header, or NULL if the region could not be mapped
+ */
+static btag * map_block(size_t size)
+{
+    size_t region_size = (size + MMAP_PAD + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+    lock_sbrk();
+    char * region = mem_map(region_size);
+    unlock_sbrk();
+
+    if (region == (void *) -1)
+    {
+        return NULL;
+    }
+
+    * (size_t *) region = region_size;
+    btag * blk_addr = (btag *) (region + MMAP_PAD);
+    put_btag(blk_addr, make_btag(0, ALLOC | MMAPPED));
+
+    return blk_addr;
+}
+
+/*
+ * remap_block
+ *
+ * Resizes the region of a block allocated by map_block, moving it if necessary.
+ * @param blk_addr address of block header
+ * @param size block size required
+ * @return new address of block header, or NULL if the region could not be resized
+ */
+static btag * remap_block(btag * blk_addr, size_t size)
+{
+    size_t region_size = (size + MMAP_PAD + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+    if (region_size == get_region_size(blk_addr))
+    {
+        return blk_addr; // same number of pages
+    }
+
+    lock_sbrk();
+    char * region = mem_remap((char *) blk_addr - MMAP_PAD, get_region_size(blk_addr), region_size);
+    unlock_sbrk();
+
+    if (region == (void *) -1)
+    {
+        return NULL;
+    }
+
+    * (size_t *) region = region_size;
+    blk_addr = (btag *) (region + MMAP_PAD);
+
+    return blk_addr;
+}
+
+/*
+ * unmap_block
+ *
+ * Releases the region of a block allocated by map_block.
+ * @param blk_addr address of block header
+ */
+static void unmap_block(btag * blk_addr)
+{
+    lock_sbrk();
+    mem_unmap((char *) blk_addr - MMAP_PAD, get_region_size(blk_addr));
+    unlock_sbrk();
+}
+
+/*
+ * get_quick_index
+ *
+ * Returns the quick list for a given block size.
+ * @param size size of block
+ * @return index
+ */
+static inline unsigned int get_quick_index(size_t size)
+{
+    return (size - MIN_BLK_SIZE) / ALIGNMENT;
+}
+
+/*
+ * quick_sweep
+ *
+ * Coalesces every block waiting in an arena's quick lists into the free lists. The arena lock must be held.
+ * @param ar arena
+ */
+static void quick_sweep(arena * ar)
+{
+    for (unsigned int i = 0; i < QUICK_NUM_BINS; i++)
+    {
+        while (ar->quick_lists[i] != NULL)
+        {
+            free_hdr * blk_addr = ar->quick_lists[i];
+            ar->quick_lists[i] = get_next_free(blk_addr);
+            free_block(ar, (btag *) blk_addr);
+        }
+    }
+
+    ar->quick_count = 0;
+}
+
+/*
+ * release_block
+ *
+ * Frees an allocated block. With deferred coalescing a small block is kept allocated in a quick list instead, and
+ * the quick lists are swept once they hold more than quick_max blocks. The arena lock must be held.
+ * @param ar arena owning the block
+ * @param blk_addr address of block header
+ */
+static void release_block(arena * ar, btag * blk_addr)
+{
+    size_t size = get_size(blk_addr);
+
+    if (!defer_coalesce || (size > QUICK_MAX_SIZE))
+    {
+        free_block(ar, blk_addr);
+        return;
+    }
+
+    unsigned int index = get_quick_index(size);
+    set_next_free((free_hdr *) blk_addr, ar->quick_lists[index]);
+    ar->quick_lists[index] = (free_hdr *) blk_addr;
+
+    if (++ar->quick_count > quick_max)
+    {
+        quick_sweep(ar);
+    }
+}
+
+/*
+ * take_block
+ *
+ * Allocates a block of exactly the given size from a quick list if one is waiting, or else from the free lists.
+ * The arena lock must be held.
+ * @param ar arena to allocate from
+ * @param size block size required
+ * @return address of allocated block header, or NULL if the heap cannot grow
+ */
+static free_hdr * take_block(arena * ar, size_t size)
+{
+    free_hdr * blk_addr;
+
+    if ((size <= QUICK_MAX_SIZE) && ((blk_addr = ar->quick_lists[get_quick_index(size)]) != NULL))
+    {
+        ar->quick_lists[get_quick_index(size)] = get_next_free(blk_addr);
+        ar->quick_count--;
+        return blk_addr; // still marked allocated
+    }
+
+    if ((blk_addr = find_fit(ar, size)) == NULL)
+    {
+        return NULL;
+    }
+
+    allocate(ar, blk_addr, size);
+
+    return blk_addr;
+}
+
+/*
+ * take_fresh_block
+ *
+ * Allocates a block as take_block does and reports from where it is known to be zero (see claim_fresh). The arena
+ * lock must be held.
+ * @param ar arena to allocate from
+ * @param size block size required
+ * @param fresh_addr where to store the address from which the block reads as zero
+ * @return address of allocated block header, or NULL if the heap cannot grow
+ */
+static free_hdr * take_fresh_block(arena * ar, size_t size, char ** fresh_addr)
+{
+    free_hdr * blk_addr;
+
+    if ((size <= QUICK_MAX_SIZE) && ((blk_addr = ar->quick_lists[get_quick_index(size)]) != NULL))
+    {
+        * fresh_addr = (char *) blk_addr + size; // used before
+        return take_block(ar, size);
+    }
+
+    if ((blk_addr = find_fit(ar, size)) == NULL)
+    {
+        return NULL;
+    }
+
+    * fresh_addr = ar->fresh; // after any heap extension by find_fit
+    allocate(ar, blk_addr, size);
+
+    return blk_addr;
+}
+
+/*
+ * get_blk_size
+ *
+ * Adjusts a request size to include the header and satisfy alignment.
+ * @param size number of bytes requested
+ * @return block size
+ */
+static inline size_t get_blk_size(size_t size)
+{
+    if (size <= MIN_BLK_SIZE - WORD_SIZE - CANARY_SIZE)
+    {
+        return MIN_BLK_SIZE;
+    }
+
+    return ALIGNMENT * ((size + WORD_SIZE + CANARY_SIZE + (ALIGNMENT - 1)) / ALIGNMENT);
+}
+
+/*
+ * get_usable_size
+ *
+ * Returns the number of payload bytes of an allocated heap or mapped block.
+ * @param blk_addr address of block header
+ * @return usable bytes
+ */
+static inline size_t get_usable_size(btag * blk_addr)
+{
+    if (get_mmapped(blk_addr))
+    {
+        return get_region_size(blk_addr) - MMAP_PAD - WORD_SIZE - CANARY_SIZE; // region less padding and header
+    }
+
+    return get_size(blk_addr) - WORD_SIZE - CANARY_SIZE;
+}
+
+#ifdef HARDENED
+/*
+ * report_corruption
+ *
+ * Reports heap corruption or misuse found by a hardened build and aborts. The message is written straight to
+ * standard error, since stdio may allocate.
+ * @param msg description of the problem
+ * @param ptr payload address involved
+ */
+static void __attribute__((noinline, noreturn, cold)) report_corruption(const char * msg, void * ptr)
+{
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "mm: %s (%p)\n", msg, ptr);
+
+    write(STDERR_FILENO, buf, (len < (int) sizeof(buf)) ? len : (int) sizeof(buf) - 1);
+    abort();
+}
+
+/*
+ * get_canary_addr
+ *
+ * Returns the address of an allocated block's canary, the last word of the block or region, which an overflow of
+ * the payload reaches first.
+ * @param blk_addr address of block header
+ * @return address of canary
+ */
+static inline unsigned int * get_canary_addr(btag * blk_addr)
+{
+    return (unsigned int *) ((char *) blk_addr + WORD_SIZE + get_usable_size(blk_addr));
+}
+
+/*
+ * make_canary
+ *
+ * Returns the canary of an allocated block, which depends on the secret, the block's address and its size, so
+ * that a header whose size was overwritten points at a word that does not hold it.
+ * @param blk_addr address of block header
+ * @return canary
+ */
+static inline unsigned int make_canary(btag * blk_addr)
+{
+    size_t size = get_mmapped(blk_addr) ? get_region_size(blk_addr) : get_size(blk_addr);
+
+    return canary_secret ^ (unsigned int) ((uintptr_t) blk_addr >> 3) ^ (unsigned int) size;
+}
+#endif
+
+/*
+ * set_canary
+ *
+ * Writes the canary of a block about to be handed out. Does nothing unless built with HARDENED.
+ * @param blk_addr address of block header
+ */
+static inline void set_canary(btag * blk_addr)
+{
+#ifdef HARDENED
+    put_val(get_canary_addr(blk_addr), make_canary(blk_addr));
+#endif
+}
+
+/*
+ * verify_block
+ *
+ * Checks a block passed to free or realloc: its header must be allocated and describe a block inside the heap,
+ * its canary must be intact, and its successor must record it as allocated. A block being freed has its canary
+ * replaced by the freed mark, which exposes a second free even while the block sits in a cache still marked
+ * allocated. Reports the problem and aborts on failure. Does nothing unless built with HARDENED.
+ * @param blk_addr address of block header
+ * @param freeing nonzero if the block is being freed
+ */
+static inline void verify_block(btag * blk_addr, int freeing)
+{
+#ifdef HARDENED
+    void * ptr = (char *) blk_addr + WORD_SIZE;
+    size_t size = get_size(blk_addr);
+
+    if (((uintptr_t) ptr % ALIGNMENT) != 0)
+    {
+        report_corruption("invalid pointer", ptr);
+    }
+
+    if (!get_alloc(blk_addr))
+    {
+        report_corruption("double free or invalid pointer", ptr);
+    }
+
+    if (get_mmapped(blk_addr))
+    {
+        size = get_region_size(blk_addr);
+
+        if ((size == 0) || (size & (mem_pagesize() - 1)) != 0)
+        {
+            report_corruption("corrupted block header", ptr);
+        }
+    }
+    else if (!is_heap_addr(blk_addr) || ((char *) blk_addr + size > (char *) mem_heap_hi()))
+    {
+        report_corruption("invalid pointer", ptr);
+    }
+    else if ((size < MIN_BLK_SIZE) || ((size % ALIGNMENT) != 0))
+    {
+        report_corruption("corrupted block header", ptr);
+    }
+
+    unsigned int * canary_addr = get_canary_addr(blk_addr);
+    unsigned int canary = make_canary(blk_addr);
+
+    if (* canary_addr != canary)
+    {
+        report_corruption((* canary_addr == (canary ^ CANARY_FREED)) ? "double free" : "heap overflow", ptr);
+    }
+
+    if (!get_mmapped(blk_addr) && !get_prev_alloc((btag *) get_next_hdr_addr(blk_addr)))
+    {
+        report_corruption("corrupted block header", ptr);
+    }
+
+    if (freeing)
+    {
+        * canary_addr = canary ^ CANARY_FREED;
+    }
+#endif
+}
+
+/*
+ * allocate_aligned
+ *
+ * Allocates a block whose payload is aligned to a power of two. A block large enough to hold the request at any
+ * alignment is taken from the free lists, and the slack before the aligned payload is returned to them. The
+ * arena lock must be held.
+ * @param ar arena to allocate from
+ * @param size block size required
+ * @param align payload alignment (power of two, greater than ALIGNMENT)
+ * @return address of allocated block header, or NULL if the heap cannot grow
+ */
+static btag * allocate_aligned(arena * ar, size_t size, size_t align)
+{
+    free_hdr * blk_addr = find_fit(ar, size + align + MIN_BLK_SIZE);
+
+    if (blk_addr == NULL)
+    {
+        return NULL;
+    }
+
+    size_t blk_size = get_size(&(blk_addr->tag));
+    size_t lead = (align - (((uintptr_t) blk_addr + WORD_SIZE) & (align - 1))) & (align - 1);
+
+    if (lead == 0)
+    {
+        allocate(ar, blk_addr, size);
+        return (btag *) blk_addr;
+    }
+
+    if (lead < MIN_BLK_SIZE)
+    {
+        lead += align; // leave room for a free block in front
+    }
+
+    free_hdr * aligned_addr = (free_hdr *) ((char *) blk_addr + lead);
+    put_btag(aligned_addr, make_btag(blk_size - lead, 0));
+    allocate(ar, aligned_addr, size);
+    add_to_free_list(ar, blk_addr, lead); // also marks the aligned block as following a free block
+    ar->stats.splits++;
+
+    return (btag *) aligned_addr;
+}
+
+/*
+ * resize_block
+ *
+ * Resizes an allocated block without moving it. A growing block absorbs its successor if that is free; when the
+ * block (or its free successor) is the last before the arena's epilogue, the heap is extended by the shortfall
+ * first. A shrinking block has its tail split off and freed. The arena lock must be held.
+ * @param ar arena owning the block
+ * @param blk_addr address of block header
+ * @param size required block size
+ * @return 1 if the block was resized, 0 if it must be moved
+ */
+static int resize_block(arena * ar, btag * blk_addr, size_t size)
+{
+    size_t blk_size = get_size(blk_addr);
+
+    if (size > blk_size)
+    {
+        btag * next_blk_addr = get_next_hdr_addr(blk_addr);
+        size_t avail = blk_size; // size of block after absorbing a free successor
+
+        if (!get_alloc(next_blk_addr))
+        {
+            avail += get_size(next_blk_addr);
+        }
+
+        if (avail < size)
+        {
+            btag * last_addr = get_alloc(next_blk_addr) ? next_blk_addr : get_next_hdr_addr(next_blk_addr);
+
+            size_t ext_size = max(size - avail, MIN_BLK_SIZE); // new memory must hold a free block
+
+            if ((last_addr != ar->epilogue) || (extend_heap(ar, ext_size / WORD_SIZE) == NULL))
+            {
+                return 0;
+            }
+
+            // The new memory is merged into the successor unless the arena had to start a new segment
+            if (get_alloc(next_blk_addr) || (blk_size + get_size(next_blk_addr) < size))
+            {
+                return 0;
+            }
+
+            avail = blk_size + get_size(next_blk_addr);
+        }
+
+        remove_from_free_list(ar, (free_hdr *) next_blk_addr);
+        untouch_block(next_blk_addr);
+        blk_size = avail;
+        put_btag(blk_addr, make_btag(blk_size, ALLOC | get_prev_alloc(blk_addr)));
+        set_prev_alloc(get_next_hdr_addr(blk_addr), 1);
+    }
+
+    touch_block(blk_addr);
+
+    if ((blk_size - size) >= MIN_BLK_SIZE)
+    {
+        // Split off tail
+        put_btag(blk_addr, make_btag(size, ALLOC | get_prev_alloc(blk_addr)));
+
+        btag * tail_addr = get_next_hdr_addr(blk_addr);
+        put_btag(tail_addr, make_btag(blk_size - size, ALLOC | PREV_ALLOC));
+        claim_fresh(ar, (char *) tail_addr);
+        free_block(ar, tail_addr);
+        ar->stats.splits++;
+    }
+    else
+    {
+        claim_fresh(ar, (char *) get_next_hdr_addr(blk_addr));
+    }
+
+    return 1;
+}
+
+#ifdef THREAD_SAFE
+/*
+ * get_tcache_index
+ *
+ * Returns the thread cache bin for a given block size.
+ * @param size size of block
+ * @return index
+ */
+static inline unsigned int get_tcache_index(size_t size)
+{
+    return (size - MIN_BLK_SIZE) / ALIGNMENT;
+}
+
+/*
+ * get_tcache_link
+ *
+ * Returns the address of the link to the next cached block, which is kept in the payload.
+ * @param blk_addr address of cached block header
+ * @return address of link
+ */
+static inline void ** get_tcache_link(void * blk_addr)
+{
+    return (void **) ((char *) blk_addr + WORD_SIZE);
+}
+
+/*
+ * get_tcache
+ *
+ * Returns the calling thread's cache, emptying it if it holds blocks from a heap discarded by mm_init.
+ * @return thread cache
+ */
+static inline tcache * get_tcache(void)
+{
+    tcache * cache = &thread_cache;
+
+    if (cache->heap_id != heap_id)
+    {
+        memset(cache, 0, sizeof(tcache));
+        cache->heap_id = heap_id;
+        pthread_setspecific(tcache_key, cache); // drain on thread exit
+    }
+
+    return cache;
+}
+
+/*
+ * tcache_drain
+ *
+ * Moves up to count blocks from a thread cache bin back to the free lists of their arenas. Consecutive blocks
+ * of the same arena are freed under a single lock.
+ * @param cache thread cache
+ * @param index bin index
+ * @param count maximum number of blocks to move
+ */
+static void tcache_drain(tcache * cache, unsigned int index, unsigned int count)
+{
+    arena * locked_ar = NULL;
+
+    while ((count > 0) && (cache->bins[index] != NULL))
+    {
+        void * blk_addr = cache->bins[index];
+        cache->bins[index] = * get_tcache_link(blk_addr);
+        cache->counts[index]--;
+
+        arena * ar = get_owner(blk_addr);
+
+        if (ar != locked_ar)
+        {
+            if (locked_ar != NULL)
+            {
+                unlock_arena(locked_ar);
+            }
+
+            lock_arena(ar);
+            locked_ar = ar;
+        }
+
+        release_block(ar, blk_addr);
+        count--;
+    }
+
+    if (locked_ar != NULL)
+    {
+        unlock_arena(locked_ar);
+    }
+}
+
+/*
+ * tcache_destroy
+ *
+ * Thread exit destructor. Returns every cached block of the exiting thread to the free lists.
+ * @param arg thread cache
+ */
+static void tcache_destroy(void * arg)
+{
+    tcache * cache = arg;
+
+    if (cache->heap_id != heap_id)
+    {
+        return; // blocks belong to a discarded heap
+    }
+
+    for (unsigned int i = 0; i < TCACHE_NUM_BINS; i++)
+    {
+        tcache_drain(cache, i, cache->counts[i]);
+    }
+}
+
+/*
+ * tcache_create_key
+ *
+ * Creates the thread-specific key whose destructor drains thread caches.
+ */
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_get
+ *
+ * Takes a block of the given size from the thread cache. An empty bin is refilled with a batch of blocks carved
+ * from the free lists of the thread's arena under a single lock. Batches start small and double with each refill of the same bin, so
+ * sizes a thread rarely uses do not tie up memory.
+ * @param size block size (no larger than TCACHE_MAX_SIZE)
+ * @return address of allocated block header, or NULL if the heap cannot grow
+ */
+static void * tcache_get(size_t size)
+{
+    tcache * cache = get_tcache();
+    unsigned int index = get_tcache_index(size);
+    void * blk_addr = cache->bins[index];
+
+    if (blk_addr != NULL)
+    {
+#ifdef HARDENED
+        if ((get_size(blk_addr) < size) || !get_alloc(blk_addr)) // refills may cache blocks a little larger
+        {
+            report_corruption("corrupted thread cache", (char *) blk_addr + WORD_SIZE);
+        }
+#endif
+
+        cache->bins[index] = * get_tcache_link(blk_addr);
+        cache->counts[index]--;
+        return blk_addr;
+    }
+
+    if (cache->refills[index] < 2)
+    {
+        cache->refills[index] = 2;
+    }
+
+    arena * ar = get_thread_arena();
+    lock_arena(ar);
+
+    blk_addr = take_block(ar, size);
+
+    for (unsigned int i = 1; (blk_addr != NULL) && (i < cache->refills[index]); i++)
+    {
+        void * extra_addr = take_block(ar, size);
+
+        if (extra_addr == NULL)
+        {
+            break; // the heap cannot grow; keep what was taken
+        }
+
+        * get_tcache_link(extra_addr) = cache->bins[index];
+        cache->bins[index] = extra_addr;
+        cache->counts[index]++;
+    }
+
+    unlock_arena(ar);
+
+    if (cache->refills[index] < TCACHE_BATCH)
+    {
+        cache->refills[index] *= 2;
+    }
+
+    return blk_addr;
+}
+
+/*
+ * tcache_put
+ *
+ * Places a block in the thread cache. A full bin is first drained by a batch of blocks.
+ * @param blk_addr address of allocated block header
+ * @param size block size (no larger than TCACHE_MAX_SIZE)
+ */
+static void tcache_put(void * blk_addr, size_t size)
+{
+    tcache * cache = get_tcache();
+    unsigned int index = get_tcache_index(size);
+
+    if (cache->counts[index] >= TCACHE_FILL)
+    {
+        tcache_drain(cache, index, TCACHE_BATCH);
+    }
+
+    * get_tcache_link(blk_addr) = cache->bins[index];
+    cache->bins[index] = blk_addr;
+    cache->counts[index]++;
+}
+#endif
+
+#ifdef SLAB_ALLOC
+/*
+ * is_slab_obj
+ *
+ * Checks whether a pointer was allocated from a slab run.
+ * @param ptr payload pointer
+ * @return nonzero if the pointer is a slab object
+ */
+static inline int is_slab_obj(void * ptr)
+{
+    size_t page = ((char *) ptr - (char *) heap_lo) / SLAB_RUN_SIZE; // huge below heap_lo
+
+    if (page >= mem_max_heap() / SLAB_RUN_SIZE)
+    {
+        return 0; // mapped outside the heap
+    }
+
+    return (slab_page_map[page / 64] >> (page % 64)) & 0x1;
+}
+
+/*
+ * set_slab_page
+ *
+ * Records whether a page of the heap holds a slab run.
+ * @param run address of run
+ * @param is_slab nonzero if the page holds the run
+ */
+static inline void set_slab_page(slab_run * run, int is_slab)
+{
+    size_t page = ((char *) run - (char *) heap_lo) / SLAB_RUN_SIZE;
+
+    if (is_slab)
+    {
+        slab_page_map[page / 64] |= (0x1UL << (page % 64));
+    }
+    else
+    {
+        slab_page_map[page / 64] &= ~(0x1UL << (page % 64));
+    }
+}
+
+/*
+ * get_slab_run
+ *
+ * Returns the run holding a slab object.
+ * @param ptr slab object
+ * @return address of run
+ */
+static inline slab_run * get_slab_run(void * ptr)
+{
+    return (slab_run *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_RUN_SIZE - 1));
+}
+
+/*
+ * get_slab_capacity
+ *
+ * Returns the number of objects in a run.
+ * @param obj_size object size
+ * @return number of objects
+ */
+static inline unsigned int get_slab_capacity(size_t obj_size)
+{
+    return (SLAB_RUN_SIZE - WORD_SIZE - SLAB_HDR_SIZE) / obj_size;
+}
+
+/*
+ * slab_unlink
+ *
+ * Removes a run from its arena's list of runs with free objects.
+ * @param ar arena owning the run
+ * @param run address of run
+ */
+static inline void slab_unlink(arena * ar, slab_run * run)
+{
+    if (run->prev == NULL)
+    {
+        ar->slabs[run->obj_size / DWORD_SIZE - 1] = run->next;
+    }
+    else
+    {
+        run->prev->next = run->next;
+    }
+
+    if (run->next != NULL)
+    {
+        run->next->prev = run->prev;
+    }
+}
+
+/*
+ * slab_push
+ *
+ * Adds a run to the front of its arena's list of runs with free objects.
+ * @param ar arena owning the run
+ * @param run address of run
+ */
+static inline void slab_push(arena * ar, slab_run * run)
+{
+    unsigned int index = run->obj_size / DWORD_SIZE - 1;
+
+    run->prev = NULL;
+    run->next = ar->slabs[index];
+
+    if (run->next != NULL)
+    {
+        run->next->prev = run;
+    }
+
+    ar->slabs[index] = run;
+}
+
+/*
+ * slab_new_run
+ *
+ * Carves a new run from the arena's free lists and makes every object in it free. The arena lock must be held.
+ * @param ar arena to allocate from
+ * @param obj_size object size
+ * @return address of run, or NULL if the heap cannot grow
+ */
+static slab_run * slab_new_run(arena * ar, size_t obj_size)
+{
+    btag * blk_addr = allocate_aligned(ar, SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+
+    if (blk_addr == NULL)
+    {
+        return NULL;
+    }
+
+    slab_run * run = (slab_run *) ((char *) blk_addr + WORD_SIZE);
+    unsigned int capacity = get_slab_capacity(obj_size);
+
+    run->obj_size = obj_size;
+    run->num_free = capacity;
+    memset(run->free_map, 0, sizeof(run->free_map));
+
+    for (unsigned int i = 0; i < capacity; i += 64)
+    {
+        run->free_map[i / 64] = ((capacity - i) >= 64) ? ~0x0UL : ((0x1UL << (capacity - i)) - 1);
+    }
+
+    set_slab_page(run, 1);
+    slab_push(ar, run);
+
+    return run;
+}
+
+/*
+ * slab_alloc
+ *
+ * Allocates an object from the first run of its size with a free object, starting a new run if there is none.
+ * A class gets its first run only after SLAB_MIN_DEMAND requests, so a few small objects do not tie up a whole run.
+ * @param size number of bytes requested (no larger than SLAB_MAX_SIZE)
+ * @return address of object, or NULL if the request should take the general path
+ */
+static void * slab_alloc(size_t size)
+{
+    size_t obj_size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    arena * ar = get_thread_arena();
+    lock_arena(ar);
+
+    unsigned int index = obj_size / DWORD_SIZE - 1;
+    slab_run * run = ar->slabs[index];
+
+    if (run == NULL)
+    {
+        if (ar->slab_demand[index] < SLAB_MIN_DEMAND)
+        {
+            ar->slab_demand[index]++;
+            unlock_arena(ar);
+            return NULL;
+        }
+
+        if ((run = slab_new_run(ar, obj_size)) == NULL)
+        {
+            unlock_arena(ar);
+            return NULL;
+        }
+    }
+
+    unsigned int word = 0;
+
+    while (run->free_map[word] == 0x0)
+    {
+        word++;
+    }
+
+    unsigned int bit = __builtin_ctzl(run->free_map[word]);
+    run->free_map[word] &= ~(0x1UL << bit);
+
+    if (--run->num_free == 0)
+    {
+        slab_unlink(ar, run); // run is full
+    }
+
+    unlock_arena(ar);
+
+    return (char *) run + SLAB_HDR_SIZE + (((word * 64) + bit) * obj_size);
+}
+
+/*
+ * slab_free
+ *
+ * Returns an object to its run. A run that becomes empty is returned to the free lists unless it is the only run
+ * of its size with free objects.
+ * @param ptr slab object
+ */
+static void slab_free(void * ptr)
+{
+    slab_run * run = get_slab_run(ptr);
+    unsigned int obj_index = ((char *) ptr - (char *) run - SLAB_HDR_SIZE) / run->obj_size;
+
+#ifdef HARDENED
+    if (((size_t) ((char *) ptr - (char *) run - SLAB_HDR_SIZE) % run->obj_size) != 0)
+    {
+        report_corruption("invalid pointer", ptr);
+    }
+#endif
+
+    arena * ar = get_owner(run);
+    lock_arena(ar);
+
+#ifdef HARDENED
+    if ((run->free_map[obj_index / 64] >> (obj_index % 64)) & 0x1)
+    {
+        report_corruption("double free", ptr); // the bitmap marks the object free already
+    }
+#endif
+
+    run->free_map[obj_index / 64] |= (0x1UL << (obj_index % 64));
+
+    if (run->num_free++ == 0)
+    {
+        slab_push(ar, run); // run was full
+    }
+    else if ((run->num_free == get_slab_capacity(run->obj_size)) && ((run->prev != NULL) || (run->next != NULL)))
+    {
+        slab_unlink(ar, run);
+        set_slab_page(run, 0);
+        free_block(ar, (btag *) ((char *) run - WORD_SIZE));
+    }
+
+    unlock_arena(ar);
+}
+#endif
+
+#ifdef HEAP_PROFILE
+/*
+ * profile_stack
+ * struct for heap profile stacks
+ *
+ * Sampled allocations are aggregated by the stack that made them. Counts and sizes are of samples as taken; the
+ * estimates scale each sample by the inverse of its probability of being sampled.
+ */
+struct profile_stack
+{
+    unsigned long hash; // hash of frames (0 for an unused entry)
+    unsigned int depth; // number of frames
+    void * frames[PROFILE_MAX_DEPTH];
+    unsigned long live_count; // sampled allocations not yet freed
+    unsigned long live_bytes;
+    unsigned long alloc_count; // sampled allocations since mm_init
+    unsigned long alloc_bytes;
+    double live_estimate; // estimated bytes not yet freed
+    double alloc_estimate; // estimated bytes allocated since mm_init
+};
+
+typedef struct profile_stack profile_stack;
+
+/*
+ * profile_sample
+ * struct for live sampled allocations
+ *
+ * Kept in an open addressing table keyed by payload address, so that free can find the stack to charge.
+ */
+struct profile_sample
+{
+    void * ptr; // payload address (NULL for an unused entry)
+    profile_stack * stack;
+    size_t size; // bytes requested
+    double estimate; // bytes the sample stands for
+};
+
+typedef struct profile_sample profile_sample;
+
+#ifdef THREAD_SAFE
+#define PROFILE_THREAD_LOCAL __thread
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; // guards stacks, samples and filter
+#else
+#define PROFILE_THREAD_LOCAL
+#endif
+
+static size_t profile_rate = PROFILE_DEFAULT_RATE; // 0 when disabled (MM_PROFILE_RATE)
+static profile_stack profile_stacks[PROFILE_NUM_STACKS];
+static profile_sample profile_samples[PROFILE_NUM_SAMPLES];
+static unsigned int profile_num_stacks; // used entries in profile_stacks
+static unsigned int profile_num_samples; // live entries in profile_samples
+static unsigned long profile_dropped; // samples lost because a table was full
+
+/*
+ * profile_filter
+ *
+ * Counts live samples by a hash of their address. free only looks a block up in profile_samples when its entry is
+ * nonzero, so freeing an unsampled block costs a single load. Read without the lock.
+ */
+static unsigned short profile_filter[PROFILE_FILTER_SIZE];
+
+static PROFILE_THREAD_LOCAL long bytes_until_sample; // bytes the thread allocates before its next sample
+static PROFILE_THREAD_LOCAL unsigned long profile_rand; // state of the thread's random number generator
+static PROFILE_THREAD_LOCAL int in_profiler; // set while the thread records a sample or dumps the profile
+
+/*
+ * lock_profile
+ *
+ * Acquires the profile lock in thread-safe mode.
+ */
+static inline void lock_profile(void)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+/*
+ * unlock_profile
+ *
+ * Releases the profile lock in thread-safe mode.
+ */
+static inline void unlock_profile(void)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+/*
+ * get_profile_hash
+ *
+ * Hashes a payload address for profile_samples and profile_filter.
+ * @param ptr payload address
+ * @return hash
+ */
+static inline unsigned long get_profile_hash(void * ptr)
+{
+    return ((uintptr_t) ptr >> 3) * 0x9E3779B97F4A7C15UL;
+}
+
+/*
+ * get_filter_index
+ *
+ * Returns the profile_filter entry for a payload address.
+ * @param ptr payload address
+ * @return index
+ */
+static inline unsigned int get_filter_index(void * ptr)
+{
+    return get_profile_hash(ptr) >> 48; // top 16 bits, unrelated to the sample table index
+}
+
+/*
+ * profile_reset
+ *
+ * Discards all samples and stacks. The tables are only cleared if something was recorded, since mm_init may be
+ * called often.
+ */
+static void profile_reset(void)
+{
+    lock_profile();
+
+    if (profile_num_stacks > 0)
+    {
+        memset(profile_stacks, 0, sizeof(profile_stacks));
+    }
+
+    if (profile_num_samples > 0)
+    {
+        memset(profile_samples, 0, sizeof(profile_samples));
+        memset(profile_filter, 0, sizeof(profile_filter));
+    }
+
+    profile_num_stacks = 0;
+    profile_num_samples = 0;
+    profile_dropped = 0;
+    unlock_profile();
+}
+
+/*
+ * next_sample_distance
+ *
+ * Draws the number of bytes until the thread's next sample from an exponential distribution with mean profile_rate,
+ * which makes every allocated byte equally likely to be sampled.
+ * @return distance in bytes
+ */
+static long next_sample_distance(void)
+{
+    if (profile_rand == 0)
+    {
+        profile_rand = (uintptr_t) &bytes_until_sample; // differs between threads
+    }
+
+    profile_rand = (profile_rand * 0x5DEECE66DUL + 0xB) & ((0x1UL << 48) - 1); // 48-bit LCG, as in drand48
+    double u = (double) (profile_rand + 1) / (double) (0x1UL << 48); // uniform in (0, 1]
+
+    return (long) (-log(u) * profile_rate) + 1;
+}
+
+/*
+ * find_profile_stack
+ *
+ * Returns the entry for a stack, creating it if needed. The profile lock must be held.
+ * @param frames return addresses
+ * @param depth number of frames
+ * @return stack entry, or NULL if the table is full
+ */
+static profile_stack * find_profile_stack(void ** frames, unsigned int depth)
+{
+    unsigned long hash = 14695981039346656037UL; // FNV-1a
+
+    for (unsigned int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (uintptr_t) frames[i]) * 1099511628211UL;
+    }
+
+    hash |= 0x1; // never 0
+
+    for (unsigned int i = 0; i < PROFILE_NUM_STACKS; i++)
+    {
+        profile_stack * stack = &profile_stacks[(hash + i) & (PROFILE_NUM_STACKS - 1)];
+
+        if (stack->hash == 0)
+        {
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void *));
+            profile_num_stacks++;
+            return stack;
+        }
+
+        if ((stack->hash == hash) && (stack->depth == depth) && !memcmp(stack->frames, frames, depth * sizeof(void *)))
+        {
+            return stack;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * profile_record
+ *
+ * Records a sampled allocation against the stack that made it and picks the thread's next sampling point.
+ * @param ptr payload address
+ * @param size bytes requested
+ */
+static void __attribute__((noinline)) profile_record(void * ptr, size_t size)
+{
+    if (in_profiler)
+    {
+        return; // allocation made by backtrace or by stdio during a dump
+    }
+
+    in_profiler = 1;
+
+    if (profile_rate == 0)
+    {
+        bytes_until_sample = PROFILE_DEFAULT_RATE; // check again later in case profiling is turned back on
+        in_profiler = 0;
+        return;
+    }
+
+    bytes_until_sample = next_sample_distance();
+
+    void * frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+    double estimate = size / (1.0 - exp(-(double) size / profile_rate)); // inverse of the sampling probability
+
+    lock_profile();
+
+    profile_stack * stack = find_profile_stack(frames + PROFILE_SKIP_FRAMES, (depth > 0) ? depth : 0);
+
+    if ((stack == NULL) || (profile_num_samples >= PROFILE_NUM_SAMPLES / 2))
+    {
+        profile_dropped++; // keep the sample table at most half full
+    }
+    else
+    {
+        unsigned int index = get_profile_hash(ptr) & (PROFILE_NUM_SAMPLES - 1);
+
+        while (profile_samples[index].ptr != NULL)
+        {
+            index = (index + 1) & (PROFILE_NUM_SAMPLES - 1);
+        }
+
+        profile_samples[index].ptr = ptr;
+        profile_samples[index].stack = stack;
+        profile_samples[index].size = size;
+        profile_samples[index].estimate = estimate;
+        profile_num_samples++;
+        __atomic_store_n(&profile_filter[get_filter_index(ptr)], profile_filter[get_filter_index(ptr)] + 1,
+                         __ATOMIC_RELAXED);
+
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->alloc_count++;
+        stack->alloc_bytes += size;
+        stack->live_estimate += estimate;
+        stack->alloc_estimate += estimate;
+    }
+
+    unlock_profile();
+
+    in_profiler = 0;
+}
+
+/*
+ * profile_forget
+ *
+ * Removes a freed block from the live samples if it was sampled. Entries after it in its probe run are shifted back
+ * so that lookups never need to skip deleted entries.
+ * @param ptr payload address
+ */
+static void profile_forget(void * ptr)
+{
+    if (in_profiler)
+    {
+        return;
+    }
+
+    lock_profile();
+
+    unsigned int index = get_profile_hash(ptr) & (PROFILE_NUM_SAMPLES - 1);
+
+    while ((profile_samples[index].ptr != NULL) && (profile_samples[index].ptr != ptr))
+    {
+        index = (index + 1) & (PROFILE_NUM_SAMPLES - 1);
+    }
+
+    if (profile_samples[index].ptr != NULL)
+    {
+        profile_stack * stack = profile_samples[index].stack;
+        stack->live_count--;
+        stack->live_bytes -= profile_samples[index].size;
+        stack->live_estimate -= profile_samples[index].estimate;
+
+        __atomic_store_n(&profile_filter[get_filter_index(ptr)], profile_filter[get_filter_index(ptr)] - 1,
+                         __ATOMIC_RELAXED);
+        profile_num_samples--;
+
+        // Backward shift deletion for linear probing
+        unsigned int hole = index;
+
+        for (unsigned int next = (hole + 1) & (PROFILE_NUM_SAMPLES - 1); profile_samples[next].ptr != NULL;
+             next = (next + 1) & (PROFILE_NUM_SAMPLES - 1))
+        {
+            unsigned int home = get_profile_hash(profile_samples[next].ptr) & (PROFILE_NUM_SAMPLES - 1);
+
+            if (((next - home) & (PROFILE_NUM_SAMPLES - 1)) >= ((next - hole) & (PROFILE_NUM_SAMPLES - 1)))
+            {
+                profile_samples[hole] = profile_samples[next]; // entry may move back into the hole
+                hole = next;
+            }
+        }
+
+        profile_samples[hole].ptr = NULL;
+    }
+
+    unlock_profile();
+}
+#endif
+
+/*
+ * profile_alloc
+ *
+ * Counts an allocation towards the thread's next heap profile sample, recording it if the sampling point is
+ * reached. Does nothing unless built with HEAP_PROFILE.
+ * @param ptr payload address
+ * @param size bytes requested
+ */
+static inline void profile_alloc(void * ptr, size_t size)
+{
+#ifdef HEAP_PROFILE
+    if ((bytes_until_sample -= size) < 0)
+    {
+        profile_record(ptr, size);
+    }
+#endif
+}
+
+/*
+ * profile_free
+ *
+ * Drops a block about to be freed from the heap profile if it was sampled. Does nothing unless built with
+ * HEAP_PROFILE.
+ * @param ptr payload address
+ */
+static inline void profile_free(void * ptr)
+{
+#ifdef HEAP_PROFILE
+    if (__atomic_load_n(&profile_filter[get_filter_index(ptr)], __ATOMIC_RELAXED) != 0)
+    {
+        profile_forget(ptr);
+    }
+#endif
+}
+
+/*
+ * profile_resize
+ *
+ * Updates the heap profile for a block resized in place. The resized block is counted as a fresh allocation.
+ * @param ptr payload address
+ * @param size bytes requested
+ */
+static inline void profile_resize(void * ptr, size_t size)
+{
+    profile_free(ptr);
+    profile_alloc(ptr, size);
+}
+
+#ifndef DRIVER
+static int initialized; // set once the library's heap exists
+#ifdef THREAD_SAFE
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER; // serializes first use
+
+/*
+ * fork_prepare
+ *
+ * Takes every allocator lock before fork, so that the child does not inherit a lock held by a thread it lacks.
+ */
+static void fork_prepare(void)
+{
+#ifdef HEAP_PROFILE
+    lock_profile(); // may be held while allocating
+#endif
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        lock_arena(&arenas[i]);
+    }
+
+    lock_sbrk();
+}
+
+/*
+ * fork_release
+ *
+ * Releases the locks taken by fork_prepare, in the parent and in the child. Blocks in the thread caches of threads
+ * the child lacks stay allocated.
+ */
+static void fork_release(void)
+{
+    unlock_sbrk();
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        unlock_arena(&arenas[i]);
+    }
+#ifdef HEAP_PROFILE
+    unlock_profile();
+#endif
+}
+#endif
+
+/*
+ * init_library
+ *
+ * Sets up the memory system and heap on first use when the allocator replaces libc's, since nothing calls mm_init.
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int __attribute__((noinline)) init_library(void)
+{
+    int result = 0;
+
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&init_lock);
+#endif
+
+    if (!initialized)
+    {
+        mem_init();
+        result = mm_init();
+
+        if (result == 0)
+        {
+            __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE); // before anything below can allocate
+#ifdef THREAD_SAFE
+            pthread_atfork(fork_prepare, fork_release, fork_release);
+#endif
+        }
+    }
+
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&init_lock);
+#endif
+
+    return result;
+}
+#endif
+
+/*
+ * ensure_init
+ *
+ * Initializes the library on first use. The driver initializes the heap itself, so this does nothing in driver
+ * builds.
+ * @return 0 if the heap exists, -1 if it cannot be created
+ */
+static inline int ensure_init(void)
+{
+#ifndef DRIVER
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+    {
+        return init_library();
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * allocate_payload
+ *
+ * Allocates a block from a slab run, a region of its own, the thread cache or the free lists, whichever suits the
+ * size. For calloc the payload is cleared, except where it is known to be zero already: a mapped region is new
+ * from the system, and heap blocks are only cleared below the arena's fresh boundary.
+ * @param size number of bytes requested
+ * @param zero nonzero to clear the payload
+ * @return address of payload, or NULL if the request cannot be met
+ */
+static inline void * allocate_payload(size_t size, int zero)
+{
+    size_t adj_size; // adjusted size to include overhead and satisfy alignment
+    size_t dirty = size; // payload bytes that may not be zero
+
+#ifndef DRIVER
+    size += (size == 0); // libc callers expect a unique pointer for a zero-byte request
+#endif
+
+    // Ignore spurious requests
+    if ((size == 0) || (size > MAX_ALLOC_SIZE) || (ensure_init() == -1))
+    {
+        return NULL;
+    }
+
+#ifdef SLAB_ALLOC
+    if (size <= SLAB_MAX_SIZE)
+    {
+        void * obj = slab_alloc(size);
+
+        if (obj != NULL)
+        {
+            if (zero)
+            {
+                memset(obj, 0, size);
+            }
+
+            return obj;
+        }
+    }
+#endif
+
+    adj_size = get_blk_size(size);
+
+    btag * blk_addr;
+
+    if (use_mapping(adj_size))
+    {
+        blk_addr = map_block(adj_size);
+        dirty = 0;
+    }
+#ifdef THREAD_SAFE
+    else if (adj_size <= TCACHE_MAX_SIZE)
+    {
+        blk_addr = tcache_get(adj_size); // no lock unless the bin is empty
+    }
+#endif
+    else
+    {
+        arena * ar = get_thread_arena();
+        char * fresh = NULL; // where the block becomes zero, for calloc
+
+        lock_arena(ar);
+        blk_addr = zero ? (btag *) take_fresh_block(ar, adj_size, &fresh) : (btag *) take_block(ar, adj_size);
+        unlock_arena(ar);
+
+        char * payload = (char *) blk_addr + WORD_SIZE;
+
+        if (zero && (blk_addr != NULL) && (fresh < payload + size))
+        {
+            dirty = (fresh > payload) ? (size_t) (fresh - payload) : 0;
+        }
+    }
+
+    if (blk_addr == NULL)
+    {
+        return NULL;
+    }
+
+    set_canary(blk_addr);
+
+    if (zero)
+    {
+        memset((char *) blk_addr + WORD_SIZE, 0, dirty); // outside the arena lock
+    }
+
+    return (char *) blk_addr + WORD_SIZE; // return address for data storage
+}
+
+/*
+ * mm_malloc
+ *
+ * Allocates a block from the free list.
+ * @param size number of bytes requested
+ * @return address of allocated block
+ */
+void * malloc(size_t size)
+{
+    void * ptr = allocate_payload(size, 0);
+
+    if (ptr != NULL)
+    {
+        profile_alloc(ptr, size);
+    }
+    else if (size != 0)
+    {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+/*
+ * mm_malloc_batch
+ *
+ * Allocates a number of blocks of the same size. Heap blocks are carved in one pass from a single free block large
+ * enough for all of them, which find_fit takes from the free lists or from a heap extension, so they lie next to
+ * each other in memory and the arena lock and free lists are touched once. If no such block can be had the batch
+ * is carved in smaller pieces. Sizes served by slab runs or regions of their own are allocated one at a time.
+ * @param size number of bytes requested for each block
+ * @param count number of blocks
+ * @param ptrs where to store the addresses of the blocks
+ * @return number of blocks allocated, which is less than count only if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t count, void ** ptrs)
+{
+    size_t done = 0; // blocks allocated so far
+
+#ifndef DRIVER
+    size += (size == 0);
+#endif
+
+    if ((size == 0) || (size > MAX_ALLOC_SIZE) || (ensure_init() == -1))
+    {
+        return 0;
+    }
+
+    size_t adj_size = get_blk_size(size);
+    int carve = !use_mapping(adj_size);
+
+#ifdef SLAB_ALLOC
+    carve = carve && (size > SLAB_MAX_SIZE);
+#endif
+
+    if (!carve)
+    {
+        while ((done < count) && ((ptrs[done] = allocate_payload(size, 0)) != NULL))
+        {
+            profile_alloc(ptrs[done++], size);
+        }
+    }
+    else
+    {
+        arena * ar = get_thread_arena();
+        size_t run = MAX_BLK_SIZE / adj_size; // blocks to carve from one free block
+
+        lock_arena(ar);
+
+        while (done < count)
+        {
+            if (run > count - done)
+            {
+                run = count - done;
+            }
+
+            free_hdr * blk_addr = find_fit(ar, run * adj_size);
+
+            if (blk_addr == NULL)
+            {
+                if (run == 1)
+                {
+                    break;
+                }
+
+                run /= 2; // a smaller piece may still fit or the heap may still grow by it
+                continue;
+            }
+
+            char * obj_addr = (char *) blk_addr;
+            size_t rest = get_size(&(blk_addr->tag));
+
+            for (size_t i = 1; i < run; i++)
+            {
+                put_btag(obj_addr, make_btag(adj_size, ALLOC | PREV_ALLOC));
+                set_canary((btag *) obj_addr);
+                touch_block(obj_addr);
+                ptrs[done++] = obj_addr + WORD_SIZE;
+                obj_addr += adj_size;
+                rest -= adj_size;
+            }
+
+            // The last block splits off or absorbs what is left
+            put_btag(obj_addr, make_btag(rest, PREV_ALLOC));
+            allocate(ar, (free_hdr *) obj_addr, adj_size);
+            set_canary((btag *) obj_addr);
+            ptrs[done++] = obj_addr + WORD_SIZE;
+            ar->stats.splits += run - 1;
+        }
+
+        unlock_arena(ar);
+
+        for (size_t i = 0; i < done; i++)
+        {
+            profile_alloc(ptrs[i], size);
+        }
+    }
+
+    if (done < count)
+    {
+        errno = ENOMEM;
+    }
+
+    return done;
+}
+
+/*
+ * free_heap_payload
+ *
+ * Frees a block that is not a slab object: its region is unmapped, or it goes to the thread cache or back to its
+ * arena.
+ * @param ptr address of payload
+ */
+static inline void free_heap_payload(void * ptr)
+{
+    btag * blk_addr = (btag *) ((char *) ptr - WORD_SIZE);
+
+    verify_block(blk_addr, 1);
+
+    if (get_mmapped(blk_addr))
+    {
+        unmap_block(blk_addr);
+        return;
+    }
+
+#ifdef THREAD_SAFE
+    size_t size = get_size(blk_addr);
+
+    if (size <= TCACHE_MAX_SIZE)
+    {
+        tcache_put(blk_addr, size); // no lock unless the bin is full
+        return;
+    }
+#endif
+
+    arena * ar = get_owner(blk_addr);
+    lock_arena(ar);
+    release_block(ar, blk_addr);
+    unlock_arena(ar);
+}
+
+/*
+ * mm_free
+ *
+ * Frees a block.
+ * @param ptr address of block to free
+ */
+void free(void * ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    profile_free(ptr);
+
+#ifdef SLAB_ALLOC
+    if (is_slab_obj(ptr))
+    {
+        slab_free(ptr);
+        return;
+    }
+#endif
+
+    free_heap_payload(ptr);
+}
+
+/*
+ * check_free_size
+ *
+ * Exits when the size passed to free_sized exceeds the usable size of its heap block. Does nothing unless built
+ * with DEBUG.
+ * @param ptr address of payload
+ * @param size size passed to free_sized
+ */
+static inline void check_free_size(void * ptr, size_t size)
+{
+#ifdef DEBUG
+    if (size > get_usable_size((btag *) ((char *) ptr - WORD_SIZE)))
+    {
+        dbg_printf("Size %zu passed to free_sized exceeds block at %p.\n", size, ptr);
+        exit(1);
+    }
+#endif
+}
+
+/*
+ * mm_free_sized
+ *
+ * Frees a block whose requested size the caller knows, as C23 free_sized. The size must be the one the block was
+ * allocated or last reallocated with. Only SLAB_ALLOC builds use it: requests larger than SLAB_MAX_SIZE never come
+ * from a slab run, so those blocks skip the slab page map. Other builds free the block as free does, since the
+ * header has to be read for the mapped bit and the owning arena anyway and a block may be larger than its request;
+ * there the size is only checked against the header, in debug builds.
+ * @param ptr address of block to free
+ * @param size number of bytes requested when the block was allocated
+ */
+void free_sized(void * ptr, size_t size)
+{
+#ifdef SLAB_ALLOC
+    if ((ptr != NULL) && (size > SLAB_MAX_SIZE))
+    {
+        check_free_size(ptr, size);
+        profile_free(ptr);
+        free_heap_payload(ptr); // cannot be a slab object
+        return;
+    }
+#else
+    if (ptr != NULL)
+    {
+        check_free_size(ptr, size);
+    }
+#endif
+
+    free(ptr);
+}
+
+/*
+ * compare_addresses
+ *
+ * Orders pointers by address. Used with qsort.
+ * @param a first pointer
+ * @param b second pointer
+ * @return negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_addresses(const void * a, const void * b)
+{
+    uintptr_t addr_a = (uintptr_t) * (void * const *) a;
+    uintptr_t addr_b = (uintptr_t) * (void * const *) b;
+
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+/*
+ * mm_free_batch
+ *
+ * Frees a number of blocks at once. The pointers are sorted by address, which reorders the caller's array, so that
+ * runs of adjacent blocks can be merged into one free block and coalesced with their neighbors in a single pass;
+ * each arena's lock is taken once per stretch of its blocks rather than once per block. Blocks bypass the thread
+ * cache. NULL pointers are skipped.
+ * @param ptrs addresses of blocks to free
+ * @param count number of pointers
+ */
+void mm_free_batch(void ** ptrs, size_t count)
+{
+    arena * locked = NULL; // arena whose lock is held
+
+    qsort(ptrs, count, sizeof(void *), compare_addresses);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        void * ptr = ptrs[i];
+
+        if (ptr == NULL)
+        {
+            continue;
+        }
+
+        profile_free(ptr);
+
+        btag * blk_addr = (btag *) ((char *) ptr - WORD_SIZE);
+
+#ifdef SLAB_ALLOC
+        int is_heap_blk = !is_slab_obj(ptr) && !get_mmapped(blk_addr);
+#else
+        int is_heap_blk = !get_mmapped(blk_addr);
+#endif
+
+        if (!is_heap_blk)
+        {
+            if (locked != NULL)
+            {
+                unlock_arena(locked); // slab_free takes the arena lock itself
+                locked = NULL;
+            }
+
+            free(ptr); // already dropped from the profile, so a second check finds nothing
+            continue;
+        }
+
+        verify_block(blk_addr, 1);
+
+        arena * ar = get_owner(blk_addr);
+
+        if (ar != locked)
+        {
+            if (locked != NULL)
+            {
+                unlock_arena(locked);
+            }
+
+            lock_arena(ar);
+            locked = ar;
+        }
+
+        // Absorb following blocks of the batch that are adjacent in the heap
+        size_t size = get_size(blk_addr);
+        unsigned int merged = 0;
+
+        while ((i + 1 < count) && ((char *) ptrs[i + 1] - WORD_SIZE == (char *) blk_addr + size))
+        {
+            profile_free(ptrs[++i]);
+            verify_block((btag *) ((char *) ptrs[i] - WORD_SIZE), 1);
+            untouch_block((char *) ptrs[i] - WORD_SIZE);
+            size += get_size((btag *) ((char *) ptrs[i] - WORD_SIZE));
+            merged++;
+        }
+
+        if (merged == 0)
+        {
+            release_block(ar, blk_addr);
+            continue;
+        }
+
+        put_btag(blk_addr, make_btag(size, get_prev_alloc(blk_addr) | ALLOC));
+        ar->stats.coalesces += merged;
+        free_block(ar, blk_addr);
+    }
+
+    if (locked != NULL)
+    {
+        unlock_arena(locked);
+    }
+}
+
+/*
+ * mm_realloc
+ *
+ * Resizes a block in place when possible: shrinking frees the tail, and growing absorbs a free successor or extends
+ * the heap. Otherwise the contents are moved to a new block.
+ * @param old_ptr old memory pointer
+ * @param size needed for data storage
+ * @return new memory pointer
+ */
+void * realloc(void * old_ptr, size_t size)
+{
+    if (size == 0)
+    {
+        free(old_ptr);
+        return NULL;
+    }
+
+    if (old_ptr == NULL)
+    {
+        return malloc(size);
+    }
+
+    if (size > MAX_ALLOC_SIZE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t old_size; // size usable for data storage
+
+#ifdef SLAB_ALLOC
+    if (is_slab_obj(old_ptr))
+    {
+        old_size = get_slab_run(old_ptr)->obj_size;
+
+        if (size <= old_size)
+        {
+            profile_resize(old_ptr, size);
+            return old_ptr; // object is already large enough
+        }
+    }
+    else
+#endif
+    if (get_mmapped((btag *) ((char *) old_ptr - WORD_SIZE)))
+    {
+        btag * blk_addr = (btag *) ((char *) old_ptr - WORD_SIZE);
+        verify_block(blk_addr, 0);
+        old_size = get_usable_size(blk_addr);
+
+        if (use_mapping(get_blk_size(size)))
+        {
+            profile_free(old_ptr); // before the old address can be mapped again
+            blk_addr = remap_block(blk_addr, get_blk_size(size)); // the system moves the pages, not the bytes
+
+            if (blk_addr == NULL)
+            {
+                return NULL;
+            }
+
+            set_canary(blk_addr);
+            profile_alloc((char *) blk_addr + WORD_SIZE, size);
+            return (char *) blk_addr + WORD_SIZE;
+        }
+    }
+    else
+    {
+        btag * blk_addr = (btag *) ((char *) old_ptr - WORD_SIZE);
+        verify_block(blk_addr, 0);
+        old_size = get_usable_size(blk_addr);
+
+        int resized = 0;
+
+        if (get_blk_size(size) <= MAX_BLK_SIZE)
+        {
+            arena * ar = get_owner(blk_addr);
+            lock_arena(ar);
+            resized = resize_block(ar, blk_addr, get_blk_size(size));
+            unlock_arena(ar);
+        }
+
+        if (resized)
+        {
+            set_canary(blk_addr);
+            profile_resize(old_ptr, size);
+            return old_ptr;
+        }
+    }
+
+    void * new_ptr = malloc(size);
+
+    if (!new_ptr)
+    {
+        return NULL;
+    }
+
+    memcpy(new_ptr, old_ptr, (size < old_size) ? size : old_size); // copy contents to new block
+    free(old_ptr); // free old block
+
+    return new_ptr;
+}
+
+/*
+ * mm_calloc
+ *
+ * Allocate block and set contents to zero. Memory that has not been used since the system handed it out is
+ * already zero and is not cleared again (see allocate_payload).
+ * @param num_elems number of elements
+ * @param elem_size size of elements
+ * @return block pointer, or NULL if the size overflows or the request cannot be met
+ */
+void * calloc(size_t num_elems, size_t elem_size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(num_elems, elem_size, &bytes))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void * ptr = allocate_payload(bytes, 1);
+
+    if (ptr != NULL)
+    {
+        profile_alloc(ptr, bytes);
+    }
+    else if (bytes != 0)
+    {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+/*
+ * mm_memalign
+ *
+ * Allocates a block whose payload is aligned to a power of two. Alignments up to ALIGNMENT are met by malloc;
+ * larger ones are carved out of a free block, whose slack in front of the aligned payload goes back to the free
+ * lists.
+ * @param align alignment (power of two)
+ * @param size number of bytes requested
+ * @return address of payload, or NULL if the alignment is invalid or the request cannot be met
+ */
+void * memalign(size_t align, size_t size)
+{
+    if ((align == 0) || ((align & (align - 1)) != 0) || (align > MAX_BLK_SIZE / 2))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((align <= ALIGNMENT) || (size == 0))
+    {
+        return malloc(size);
+    }
+
+    if ((size > MAX_BLK_SIZE - align - 2 * MIN_BLK_SIZE) || (ensure_init() == -1))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    arena * ar = get_thread_arena();
+    lock_arena(ar);
+    btag * blk_addr = allocate_aligned(ar, get_blk_size(size), align);
+    unlock_arena(ar);
+
+    if (blk_addr == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    set_canary(blk_addr);
+    profile_alloc((char *) blk_addr + WORD_SIZE, size);
+
+    return (char *) blk_addr + WORD_SIZE;
+}
+
+/*
+ * mm_posix_memalign
+ *
+ * Allocates a block whose payload is aligned to a power of two, as POSIX specifies. errno is left unchanged.
+ * @param memptr set to the address of the payload if successful
+ * @param align alignment (power of two multiple of sizeof(void *))
+ * @param size number of bytes requested
+ * @return 0 if successful, EINVAL if the alignment is invalid, ENOMEM if the request cannot be met
+ */
+int posix_memalign(void ** memptr, size_t align, size_t size)
+{
+    if ((align < sizeof(void *)) || ((align & (align - 1)) != 0))
+    {
+        return EINVAL;
+    }
+
+    int saved_errno = errno;
+    void * ptr = memalign(align, size);
+    int result = ((ptr == NULL) && (size != 0)) ? errno : 0;
+
+    errno = saved_errno;
+
+    if (result == 0)
+    {
+        * memptr = ptr;
+    }
+
+    return result;
+}
+
+/*
+ * mm_aligned_alloc
+ *
+ * Allocates a block whose payload is aligned to a power of two, as C11 specifies.
+ * @param align alignment (power of two)
+ * @param size number of bytes requested
+ * @return address of payload, or NULL if unsuccessful
+ */
+void * aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+/*
+ * mm_valloc
+ *
+ * Allocates a page-aligned block.
+ * @param size number of bytes requested
+ * @return address of payload, or NULL if unsuccessful
+ */
+void * valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+/*
+ * mm_pvalloc
+ *
+ * Allocates a page-aligned block whose size is rounded up to whole pages.
+ * @param size number of bytes requested
+ * @return address of payload, or NULL if unsuccessful
+ */
+void * pvalloc(size_t size)
+{
+    size_t page_size = mem_pagesize();
+
+    if (size > MAX_BLK_SIZE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return memalign(page_size, (size == 0) ? page_size : (size + page_size - 1) & ~(page_size - 1));
+}
+
+/*
+ * mm_malloc_usable_size
+ *
+ * Returns the number of bytes that may be used in an allocated block, which can exceed the size requested.
+ * @param ptr address of payload
+ * @return usable bytes, or 0 if ptr is NULL
+ */
+size_t malloc_usable_size(void * ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+
+#ifdef SLAB_ALLOC
+    if (is_slab_obj(ptr))
+    {
+        return get_slab_run(ptr)->obj_size;
+    }
+#endif
+
+    return get_usable_size((btag *) ((char *) ptr - WORD_SIZE));
+}
+
+/*
+ * mm_mallopt
+ *
+ * Sets an allocator parameter. Settings persist across mm_init.
+ *  MM_DEFER_COALESCE: nonzero keeps freed blocks of up to QUICK_MAX_SIZE bytes in quick lists, coalescing them
+ *                     only when find_fit misses or the lists grow too long; zero sweeps the lists and turns this off
+ *  MM_QUICK_MAX: number of quick list blocks per arena that triggers a coalescing sweep
+ *  MM_MMAP_THRESHOLD: smallest block size given a region of its own (0 disables)
+ *  MM_TRIM_THRESHOLD: free space at the top of the heap that is returned to the system (0 disables)
+ *  MM_PROFILE_RATE: mean number of bytes allocated between heap profile samples (0 disables; HEAP_PROFILE only)
+ *  MM_FIT_POLICY: placement policy for the size class lists, one of MM_FIT_LIFO (insert at the head, first fit),
+ *                 MM_FIT_ADDRESS (address ordered treaps, lowest addressed fit), MM_FIT_NEXT (first fit from a
+ *                 roving pointer) and MM_FIT_BEST (smallest fit); switching to or from MM_FIT_ADDRESS rebuilds the
+ *                 size classes
+ * @param param parameter
+ * @param value new value
+ * @return 1 if successful, 0 if the parameter or value is invalid
+ */
+int mm_mallopt(int param, int value)
+{
+    if (param == MM_DEFER_COALESCE)
+    {
+        if (!value)
+        {
+            for (unsigned int i = 0; i < num_arenas; i++)
+            {
+                lock_arena(&arenas[i]);
+                quick_sweep(&arenas[i]);
+                unlock_arena(&arenas[i]);
+            }
+        }
+
+        defer_coalesce = (value != 0);
+        return 1;
+    }
+
+    if ((param == MM_QUICK_MAX) && (value >= 0))
+    {
+        quick_max = value;
+        return 1;
+    }
+
+    if ((param == MM_MMAP_THRESHOLD) && (value >= 0))
+    {
+        mmap_threshold = value;
+        return 1;
+    }
+
+    if ((param == MM_TRIM_THRESHOLD) && (value >= 0))
+    {
+        trim_threshold = value;
+        return 1;
+    }
+
+    if ((param == MM_FIT_POLICY) && (value >= MM_FIT_LIFO) && (value <= MM_FIT_BEST))
+    {
+        // Moving to or from MM_FIT_ADDRESS turns the lists into treaps or back, so no arena may search meanwhile
+        int rebuild = ((value == MM_FIT_ADDRESS) != (fit_policy == MM_FIT_ADDRESS));
+        free_hdr * chains[MAX_ARENAS];
+
+        for (unsigned int i = 0; i < num_arenas; i++)
+        {
+            lock_arena(&arenas[i]);
+            chains[i] = NULL;
+
+            // Take out every block below the last class, chained through its next link
+            for (unsigned char index = 0; rebuild && (index < TREE_CLASS); index++)
+            {
+                free_hdr * blk_addr;
+
+                while ((blk_addr = arenas[i].free_lists[index]) != NULL)
+                {
+                    remove_from_free_list(&arenas[i], blk_addr);
+                    set_next_free(blk_addr, chains[i]);
+                    chains[i] = blk_addr;
+                }
+            }
+
+            arenas[i].rover = NULL;
+        }
+
+        fit_policy = value;
+
+        for (unsigned int i = 0; i < num_arenas; i++)
+        {
+            while (chains[i] != NULL)
+            {
+                free_hdr * blk_addr = chains[i];
+                chains[i] = get_next_free(blk_addr);
+                add_to_free_list(&arenas[i], blk_addr, get_size(&(blk_addr->tag)));
+            }
+
+            unlock_arena(&arenas[i]);
+        }
+
+        return 1;
+    }
+
+#ifdef HEAP_PROFILE
+    if ((param == MM_PROFILE_RATE) && (value >= 0))
+    {
+        profile_rate = value;
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * count_free_blk
+ *
+ * Adds a free block to the statistics being gathered by mm_stats.
+ * @param stats statistics
+ * @param size block size
+ */
+static void count_free_blk(struct mm_stats * stats, size_t size)
+{
+    stats->free_bytes += size;
+    stats->free_blocks[get_free_lists_index(size)]++;
+
+    if (size > stats->largest_free)
+    {
+        stats->largest_free = size;
+    }
+}
+
+/*
+ * mm_stats
+ *
+ * Reports allocator statistics. Sizes and the free block histogram come from a walk of every heap segment with all
+ * arenas locked. Blocks waiting in quick lists count as free; blocks held in thread caches or slab runs count as
+ * live, and so does the whole region of each mapped block. Event counters are summed over arenas and cover
+ * everything since mm_init.
+ * @param stats structure to fill in
+ */
+void mm_stats(struct mm_stats * stats)
+{
+    memset(stats, 0, sizeof(struct mm_stats));
+    stats->num_classes = NUM_SIZE_CLASSES;
+
+    for (unsigned int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        stats->class_min_size[i] = size_class_min_blk[i];
+    }
+
+    if (num_arenas == 0)
+    {
+        return; // no heap yet
+    }
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        lock_arena(&arenas[i]);
+    }
+
+    lock_sbrk();
+
+    char * heap_top = (char *) mem_heap_hi() + 1;
+    btag * blk_ptr = (btag *) heap_ptr;
+
+    // Walk each segment
+    while ((char *) blk_ptr < heap_top)
+    {
+        while (get_size(blk_ptr) != 0) // stop at epilogue
+        {
+            if (get_alloc(blk_ptr))
+            {
+                stats->live_bytes += get_size(blk_ptr);
+            }
+            else
+            {
+                count_free_blk(stats, get_size(blk_ptr));
+            }
+
+            blk_ptr = get_next_hdr_addr(blk_ptr);
+        }
+
+        blk_ptr = (btag *) ((char *) blk_ptr + (4 * WORD_SIZE)); // skip padding and prologue of next segment
+    }
+
+    stats->heap_size = mem_heapsize();
+    stats->mapped_size = mem_mapsize();
+    stats->live_bytes += stats->mapped_size;
+
+    unlock_sbrk();
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        for (unsigned int index = 0; index < QUICK_NUM_BINS; index++)
+        {
+            for (free_hdr * quick_blk_ptr = arenas[i].quick_lists[index]; quick_blk_ptr != NULL;
+                 quick_blk_ptr = get_next_free(quick_blk_ptr))
+            {
+                stats->live_bytes -= get_size(&(quick_blk_ptr->tag));
+                count_free_blk(stats, get_size(&(quick_blk_ptr->tag)));
+            }
+        }
+
+        stats->splits += arenas[i].stats.splits;
+        stats->coalesces += arenas[i].stats.coalesces;
+        stats->extends += arenas[i].stats.extends;
+        stats->trims += arenas[i].stats.trims;
+        stats->fit_calls += arenas[i].stats.fit_calls;
+        stats->fit_scans += arenas[i].stats.fit_scans;
+
+        unlock_arena(&arenas[i]);
+    }
+}
+
+#ifdef HEAP_PROFILE
+/*
+ * compare_stacks
+ *
+ * Orders heap profile stacks by estimated live bytes, largest first. Used with qsort.
+ * @param a first stack index
+ * @param b second stack index
+ * @return negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_stacks(const void * a, const void * b)
+{
+    double live_a = profile_stacks[* (const unsigned int *) a].live_estimate;
+    double live_b = profile_stacks[* (const unsigned int *) b].live_estimate;
+
+    return (live_a < live_b) - (live_a > live_b);
+}
+
+/*
+ * mm_profile_dump
+ *
+ * Writes the heap profile. MM_PROFILE_PPROF gives the legacy heap profile format read by pprof, which scales samples
+ * by the sampling rate itself, followed by the process's memory map for symbolization. MM_PROFILE_FLAT gives one
+ * entry per stack, largest estimated live bytes first, with its frames symbolized.
+ * @param out stream to write to
+ * @param format MM_PROFILE_PPROF or MM_PROFILE_FLAT
+ * @return 0 if successful, -1 if the format is invalid or the allocator was built without HEAP_PROFILE
+ */
+int mm_profile_dump(FILE * out, int format)
+{
+    static unsigned int order[PROFILE_NUM_STACKS]; // indices of used stacks
+    unsigned int num_stacks = 0;
+
+    if ((format != MM_PROFILE_PPROF) && (format != MM_PROFILE_FLAT))
+    {
+        return -1;
+    }
+
+    in_profiler = 1; // allocations made by stdio are not sampled
+    lock_profile();
+
+    unsigned long live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+
+    for (unsigned int i = 0; i < PROFILE_NUM_STACKS; i++)
+    {
+        if (profile_stacks[i].hash != 0)
+        {
+            order[num_stacks++] = i;
+            live_count += profile_stacks[i].live_count;
+            live_bytes += profile_stacks[i].live_bytes;
+            alloc_count += profile_stacks[i].alloc_count;
+            alloc_bytes += profile_stacks[i].alloc_bytes;
+        }
+    }
+
+    qsort(order, num_stacks, sizeof(unsigned int), compare_stacks);
+
+    if (format == MM_PROFILE_PPROF)
+    {
+        fprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%zu\n", live_count, live_bytes, alloc_count,
+                alloc_bytes, profile_rate);
+
+        for (unsigned int i = 0; i < num_stacks; i++)
+        {
+            profile_stack * stack = &profile_stacks[order[i]];
+            fprintf(out, "%lu: %lu [%lu: %lu] @", stack->live_count, stack->live_bytes, stack->alloc_count,
+                    stack->alloc_bytes);
+
+            for (unsigned int j = 0; j < stack->depth; j++)
+            {
+                fprintf(out, " %p", stack->frames[j]);
+            }
+
+            fprintf(out, "\n");
+        }
+
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+
+        FILE * maps = fopen("/proc/self/maps", "r");
+
+        if (maps != NULL)
+        {
+            char buf[4096];
+            size_t len;
+
+            while ((len = fread(buf, 1, sizeof(buf), maps)) > 0)
+            {
+                fwrite(buf, 1, len, out);
+            }
+
+            fclose(maps);
+        }
+    }
+    else
+    {
+        fprintf(out, "# heap profile: sampling rate %zu bytes, %lu samples dropped\n", profile_rate, profile_dropped);
+        fprintf(out, "# estimated live bytes, estimated allocated bytes, live samples, allocated samples\n");
+
+        for (unsigned int i = 0; i < num_stacks; i++)
+        {
+            profile_stack * stack = &profile_stacks[order[i]];
+            fprintf(out, "%.0f %.0f %lu %lu\n", stack->live_estimate, stack->alloc_estimate, stack->live_count,
+                    stack->alloc_count);
+            fflush(out);
+            backtrace_symbols_fd(stack->frames, stack->depth, fileno(out)); // one line per frame, no allocation
+        }
+    }
+
+    fflush(out);
+
+    unlock_profile();
+    in_profiler = 0;
+
+    return 0;
+}
+#else
+int mm_profile_dump(FILE * out, int format)
+{
+    return -1;
+}
+#endif
+
+#ifdef DEBUG
+/*
+ * check_tree
+ *
+ * Checks the ordering and heap property of a treap. Exits when an error is detected.
+ * @param index size class of the treap
+ * @param node subtree root
+ * @return number of nodes in subtree
+ */
+static size_t check_tree(unsigned char index, tree_node * node)
+{
+    if (node == NULL)
+    {
+        return 0;
+    }
+
+    tree_node * left = get_prev_free(node);
+    tree_node * right = get_next_free(node);
+
+    if (((left != NULL) && (!tree_less(index, left, node) || (get_priority(left) > get_priority(node)))) ||
+        ((right != NULL) && (!tree_less(index, node, right) || (get_priority(right) > get_priority(node)))))
+    {
+        dbg_printf("Treap out of order at block address %p.\n", node);
+        exit(1);
+    }
+
+    return 1 + check_tree(index, left) + check_tree(index, right);
+}
+
+/*
+ * mm_checkheap
+ *
+ * Checks the heap for correctness. Exits when an error is detected.
+ * @param verbose level of checking involved (not utilized)
+ */
+void mm_checkheap(int verbose)
+{
+    size_t num_free_blks[MAX_ARENAS][NUM_SIZE_CLASSES];
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        for (int j = 0; j < NUM_SIZE_CLASSES; j++)
+        {
+            num_free_blks[i][j] = 0;
+        }
+    }
+
+    char * heap_top = (char *) mem_heap_hi() + 1;
+    btag * blk_ptr = (btag *) heap_ptr;
+
+    // Check each segment
+    while ((char *) blk_ptr < heap_top)
+    {
+        // Check prologue
+        if (* (unsigned int *) ((char *) blk_ptr - DWORD_SIZE) != 9)
+        {
+            dbg_printf("Invalid prologue header.\n");
+            exit(1);
+        }
+
+        if (* (unsigned int *) ((char *) blk_ptr - WORD_SIZE) != 9)
+        {
+            dbg_printf("Invalid prologue footer.\n");
+            exit(1);
+        }
+
+        unsigned int ar_index = get_owner(blk_ptr) - arenas;
+        size_t prev_alloc = 1; // prologue
+
+        // Check blocks and epilogue
+        while (1)
+        {
+            size_t size = get_size(blk_ptr);
+            size_t alloc = get_alloc(blk_ptr);
+
+            if ((get_prev_alloc(blk_ptr) != 0) != prev_alloc)
+            {
+                dbg_printf("Previous block status is wrong at block address %p.\n", blk_ptr);
+                exit(1);
+            }
+
+            if ((size == 0) && (alloc == 1)) // stop at epilogue
+            {
+                break;
+            }
+
+            if (!alloc && !prev_alloc)
+            {
+                dbg_printf("Free blocks were not coalesced at block address %p.\n", blk_ptr);
+                exit(1);
+            }
+
+            if (!alloc && (get_size((btag *) get_ftr_addr(blk_ptr)) != size))
+            {
+                dbg_printf("Block header and footer do not agree at block address %p.\n", blk_ptr);
+                exit(1);
+            }
+
+            if (get_owner(blk_ptr) != &arenas[ar_index])
+            {
+                dbg_printf("Block at address %p crosses into another arena.\n", blk_ptr);
+                exit(1);
+            }
+
+            if ((((uintptr_t) blk_ptr + WORD_SIZE) & (ALIGNMENT - 1)) || (size & (ALIGNMENT - 1)))
+            {
+                dbg_printf("Block at address %p is not aligned.\n", blk_ptr);
+                exit(1);
+            }
+
+            if (alloc == 0)
+            {
+                unsigned char index = get_free_lists_index(size);
+
+                if ((size < size_class_min_blk[index]) ||
+                    ((index < NUM_SIZE_CLASSES - 1) && (size >= size_class_min_blk[index + 1])))
+                {
+                    dbg_printf("Free block at address %p is outside its size class.\n", blk_ptr);
+                    exit(1);
+                }
+
+                num_free_blks[ar_index][index]++;
+            }
+
+            prev_alloc = alloc;
+            blk_ptr = get_next_hdr_addr(blk_ptr);
+        }
+
+        blk_ptr = (btag *) ((char *) blk_ptr + (4 * WORD_SIZE)); // skip padding and prologue of next segment
+    }
+
+    // Check free lists
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        unsigned char index = 0;
+        while (index < NUM_SIZE_CLASSES)
+        {
+            free_hdr * free_blk_ptr = arenas[i].free_lists[index];
+            size_t blk_count = 0;
+
+            if (is_tree_class(index))
+            {
+                blk_count = check_tree(index, free_blk_ptr);
+                free_blk_ptr = NULL;
+            }
+
+            while (free_blk_ptr != NULL)
+            {
+                blk_count++;
+                free_blk_ptr = get_next_free(free_blk_ptr);
+            }
+
+            if ((blk_count != 0) != ((arenas[i].nonempty >> index) & 0x1))
+            {
+                dbg_printf("Free list bitmap is wrong for arena %u index %u.\n", i, index);
+                exit(1);
+            }
+
+            if (blk_count != num_free_blks[i][index])
+            {
+                dbg_printf("Free list does not agree with number of free blocks for arena %u index %u.\n", i, index);
+                exit(1);
+            }
+
+            index++;
+        }
+    }
+
+    // Check rovers
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        free_hdr * rover = arenas[i].rover;
+
+        if ((rover != NULL) && (get_alloc(&(rover->tag)) || (get_owner(rover) != &arenas[i]) ||
+                                (get_free_lists_index(get_size(&(rover->tag))) == TREE_CLASS)))
+        {
+            dbg_printf("Rover of arena %u is not a free list block.\n", i);
+            exit(1);
+        }
+    }
+
+    // Check that calloc may skip clearing the heap past each fresh boundary
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        if (arenas[i].epilogue == NULL)
+        {
+            continue;
+        }
+
+        for (char * mem_addr = arenas[i].fresh; mem_addr < (char *) arenas[i].epilogue - WORD_SIZE; mem_addr++)
+        {
+            if (* mem_addr != 0)
+            {
+                dbg_printf("Heap at %p past the fresh boundary of arena %u is not zero.\n", mem_addr, i);
+                exit(1);
+            }
+        }
+    }
+
+    // Check quick lists
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        unsigned int quick_count = 0;
+
+        for (unsigned int index = 0; index < QUICK_NUM_BINS; index++)
+        {
+            for (free_hdr * quick_blk_ptr = arenas[i].quick_lists[index]; quick_blk_ptr != NULL;
+                 quick_blk_ptr = get_next_free(quick_blk_ptr))
+            {
+                if (!get_alloc(&(quick_blk_ptr->tag)) || (get_quick_index(get_size(&(quick_blk_ptr->tag))) != index) ||
+                    (get_owner(quick_blk_ptr) != &arenas[i]))
+                {
+                    dbg_printf("Quick list block at address %p is inconsistent.\n", quick_blk_ptr);
+                    exit(1);
+                }
+
+                quick_count++;
+            }
+        }
+
+        if (quick_count != arenas[i].quick_count)
         {
-            dbg_printf("Free list does not agree with number of free blocks for index %u.\n", index);
+            dbg_printf("Quick list count is wrong for arena %u.\n", i);
             exit(1);
         }
+    }
+
+#ifdef SLAB_ALLOC
+    // Check slab runs with free objects
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        for (unsigned int index = 0; index < SLAB_NUM_CLASSES; index++)
+        {
+            for (slab_run * run = arenas[i].slabs[index]; run != NULL; run = run->next)
+            {
+                unsigned int num_free = 0;
 
-        index++;
+                for (unsigned int word = 0; word < SLAB_MAP_WORDS; word++)
+                {
+                    num_free += __builtin_popcountl(run->free_map[word]);
+                }
+
+                if (!is_slab_obj(run) || (get_owner(run) != &arenas[i]) || (run->obj_size != (index + 1) * DWORD_SIZE) ||
+                    (run->num_free != num_free) || (num_free == 0) || (num_free > get_slab_capacity(run->obj_size)))
+                {
+                    dbg_printf("Slab run at address %p is inconsistent.\n", run);
+                    exit(1);
+                }
+            }
+        }
     }
+#endif
+
+    num_touched = 0; // the whole heap has been checked
+    touch_overflow = 0;
 
     dbg_printf("Heap seems okay.\n");
 }
+
+/*
+ * check_touched_block
+ *
+ * Checks one block and its links to the blocks around it: its boundary tags and alignment, the previous-allocated
+ * bits it shares with its neighbors, and for a free block its size class and the free list or treap links to and
+ * from it. Exits when an error is detected.
+ * @param blk_addr address of block header
+ */
+static void check_touched_block(btag * blk_addr)
+{
+    if ((char *) blk_addr >= (char *) mem_heap_hi())
+    {
+        return; // trimmed away
+    }
+
+    size_t size = get_size(blk_addr);
+    size_t alloc = get_alloc(blk_addr);
+    btag * next_blk_addr = get_next_hdr_addr(blk_addr);
+
+    if ((((uintptr_t) blk_addr + WORD_SIZE) & (ALIGNMENT - 1)) || (size & (ALIGNMENT - 1)) || (size < MIN_BLK_SIZE) ||
+        ((char *) next_blk_addr > (char *) mem_heap_hi()))
+    {
+        dbg_printf("Block at address %p is not aligned or overruns the heap.\n", blk_addr);
+        exit(1);
+    }
+
+    if ((get_prev_alloc(next_blk_addr) != 0) != alloc)
+    {
+        dbg_printf("Previous block status is wrong at block address %p.\n", next_blk_addr);
+        exit(1);
+    }
+
+    if (!get_prev_alloc(blk_addr))
+    {
+        btag * prev_blk_addr = get_prev_hdr_addr(blk_addr);
+
+        if (get_alloc(prev_blk_addr) || (get_next_hdr_addr(prev_blk_addr) != blk_addr))
+        {
+            dbg_printf("Previous block status is wrong at block address %p.\n", blk_addr);
+            exit(1);
+        }
+    }
+
+    if (alloc)
+    {
+        return;
+    }
+
+    if (!get_prev_alloc(blk_addr) || !get_alloc(next_blk_addr))
+    {
+        dbg_printf("Free blocks were not coalesced at block address %p.\n", blk_addr);
+        exit(1);
+    }
+
+    if (get_size((btag *) get_ftr_addr(blk_addr)) != size)
+    {
+        dbg_printf("Block header and footer do not agree at block address %p.\n", blk_addr);
+        exit(1);
+    }
+
+    arena * ar = get_owner(blk_addr);
+    unsigned char index = get_free_lists_index(size);
+    free_hdr * prev_addr = get_prev_free((free_hdr *) blk_addr);
+    free_hdr * next_addr = get_next_free((free_hdr *) blk_addr);
+
+    if ((size < size_class_min_blk[index]) || ((index < NUM_SIZE_CLASSES - 1) && (size >= size_class_min_blk[index + 1])))
+    {
+        dbg_printf("Free block at address %p is outside its size class.\n", blk_addr);
+        exit(1);
+    }
+
+    if (((ar->nonempty >> index) & 0x1) == 0)
+    {
+        dbg_printf("Free list bitmap is wrong for the free block at address %p.\n", blk_addr);
+        exit(1);
+    }
+
+    if (is_tree_class(index))
+    {
+        if (((prev_addr != NULL) && (!tree_less(index, prev_addr, (tree_node *) blk_addr) ||
+                                     (get_priority(prev_addr) > get_priority((tree_node *) blk_addr)))) ||
+            ((next_addr != NULL) && (!tree_less(index, (tree_node *) blk_addr, next_addr) ||
+                                     (get_priority(next_addr) > get_priority((tree_node *) blk_addr)))))
+        {
+            dbg_printf("Treap out of order at block address %p.\n", blk_addr);
+            exit(1);
+        }
+
+        return;
+    }
+
+    if (((prev_addr == NULL) ? (ar->free_lists[index] != (free_hdr *) blk_addr) :
+         (get_next_free(prev_addr) != (free_hdr *) blk_addr)) ||
+        ((next_addr != NULL) && (get_prev_free(next_addr) != (free_hdr *) blk_addr)))
+    {
+        dbg_printf("Free list links are broken at block address %p.\n", blk_addr);
+        exit(1);
+    }
+}
+
+/*
+ * mm_checkheap_touched
+ *
+ * Checks only the blocks created or changed since the last heap check, with their neighbors and free list links,
+ * and the free list bitmaps. Each check costs time in proportion to the blocks an operation changed rather than
+ * to the heap, so it can follow every operation of a long trace; an occasional mm_checkheap covers the rest. The
+ * whole heap is checked when too many blocks changed. Meant for single-threaded callers. Exits when an error is
+ * detected.
+ */
+void mm_checkheap_touched(void)
+{
+    if (touch_overflow)
+    {
+        mm_checkheap(0);
+        return;
+    }
+
+    for (unsigned int i = 0; i < num_touched; i++)
+    {
+        check_touched_block(touched_blks[i]);
+    }
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        for (int j = 0; j < NUM_SIZE_CLASSES; j++)
+        {
+            if ((arenas[i].free_lists[j] != NULL) != ((arenas[i].nonempty >> j) & 0x1))
+            {
+                dbg_printf("Free list bitmap is wrong for arena %u index %u.\n", i, j);
+                exit(1);
+            }
+        }
+    }
+
+    num_touched = 0;
+}
 #else
 void mm_checkheap(int verbose)
 {
     return;
 }
+
+void mm_checkheap_touched(void)
+{
+    return;
+}
 #endif
 
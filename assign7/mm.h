@@ -7,6 +7,14 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+/* size used only by SLAB_ALLOC builds, to skip the slab lookup above 64 bytes */
+extern void mm_free_sized(void *ptr, size_t size);
 
 #else
 
@@ -15,11 +23,72 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern size_t malloc_usable_size(void *ptr);
+/* size used only by SLAB_ALLOC builds, to skip the slab lookup above 64 bytes */
+extern void free_sized(void *ptr, size_t size);
 
 #endif
 
 extern int mm_init(void);
+extern int mm_init_arenas(unsigned int count);
+
+/* allocate count blocks of size bytes at once; returns the number allocated */
+extern size_t mm_malloc_batch(size_t size, size_t count, void **ptrs);
+
+/* free count blocks at once; sorts ptrs by address */
+extern void mm_free_batch(void **ptrs, size_t count);
+
+/* parameters for mm_mallopt */
+#define MM_DEFER_COALESCE 1 /* nonzero to defer coalescing of small freed blocks */
+#define MM_QUICK_MAX 2      /* deferred blocks per arena that trigger a coalescing sweep */
+#define MM_MMAP_THRESHOLD 3 /* smallest block given its own mapped region (0 disables) */
+#define MM_TRIM_THRESHOLD 4 /* free heap top size returned to the system (0 disables) */
+#define MM_PROFILE_RATE 5   /* mean bytes allocated between heap profile samples (0 disables) */
+#define MM_FIT_POLICY 6     /* free block placement policy, one of MM_FIT_* */
+
+/* placement policies for MM_FIT_POLICY */
+#define MM_FIT_LIFO 0    /* newest free block first, first fit (default) */
+#define MM_FIT_ADDRESS 1 /* free lists in address order, first fit */
+#define MM_FIT_NEXT 2    /* first fit resuming where the last search stopped */
+#define MM_FIT_BEST 3    /* smallest fitting block */
+
+extern int mm_mallopt(int param, int value);
+
+/* allocator statistics filled in by mm_stats */
+#define MM_STATS_MAX_CLASSES 64
+
+struct mm_stats
+{
+    size_t heap_size;    /* bytes obtained with mem_sbrk */
+    size_t mapped_size;  /* bytes in regions of mapped blocks */
+    size_t live_bytes;   /* bytes in allocated blocks, headers included */
+    size_t free_bytes;   /* bytes in free blocks */
+    size_t largest_free; /* size of largest free block */
+    unsigned int num_classes;                        /* number of size classes */
+    size_t class_min_size[MM_STATS_MAX_CLASSES];     /* smallest block in each class */
+    unsigned long free_blocks[MM_STATS_MAX_CLASSES]; /* free blocks in each class */
+    unsigned long splits;    /* free blocks split by an allocation or resize */
+    unsigned long coalesces; /* free neighbors merged into a freed block */
+    unsigned long extends;   /* heap extensions */
+    unsigned long trims;     /* heap shrinks */
+    unsigned long fit_calls; /* free list searches */
+    unsigned long fit_scans; /* free blocks examined by first fit searches */
+};
+
+extern void mm_stats(struct mm_stats *stats);
+
+/* heap profile formats for mm_profile_dump (needs -DHEAP_PROFILE) */
+#define MM_PROFILE_PPROF 0 /* legacy pprof heap profile */
+#define MM_PROFILE_FLAT 1  /* estimated bytes and symbolized frames per stack */
+
+extern int mm_profile_dump(FILE *out, int format);
 
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+extern void mm_checkheap_touched(void);